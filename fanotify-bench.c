@@ -0,0 +1,513 @@
+/* Throughput benchmark: marks a temporary directory the same way
+ * fanotify-cmdline does, drives file operation storms into it from
+ * several threads and processes the resulting events with the regular
+ * code paths, output going to /dev/null unless told otherwise. */
+#define FANOTIFY_CMDLINE_NO_MAIN
+#include "fanotify-cmdline.c"
+
+#include <sys/wait.h>
+
+/* Defaults of the storm */
+#define BENCH_THREADS 4
+#define BENCH_FILES 16
+#define BENCH_DURATION 5
+#define BENCH_OPS "orw"
+
+/* Size of the files operated on */
+#define BENCH_FILE_SIZE 4096
+
+/* Maximum number of latency samples kept */
+#define BENCH_MAX_PROBES (1024 * 1024)
+
+/* Delay between two latency probes, in microseconds */
+#define BENCH_PROBE_INTERVAL 1000
+
+/* Time after which a probe is considered lost, in nanoseconds */
+#define BENCH_PROBE_TIMEOUT 1000000000ULL
+
+/* A storm thread, operating on its own set of files */
+typedef struct {
+  pthread_t thread;
+  int index;
+  unsigned long long ops;
+} bench_thread_t;
+
+/* Shared with the probe process. The probe reads a file of its own, its
+ * PID tells its events apart; one probe is in flight at a time. */
+typedef struct {
+  _Atomic unsigned long seq;
+  _Atomic unsigned long acked;
+  _Atomic uint64_t sent;
+  _Atomic int stop;
+} bench_probe_t;
+
+static const char *bench_dir;
+static int bench_n_files = BENCH_FILES;
+static const char *bench_ops = BENCH_OPS;
+static atomic_int bench_stop;
+
+static bench_probe_t *probe;
+static pid_t probe_pid = -1;
+static uint64_t *latencies;
+static size_t n_latencies;
+
+static uint64_t bench_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void bench_file_path(char *path, size_t size, int thread, int file) {
+    snprintf(path, size, "%s/t%d-%d", bench_dir, thread, file);
+}
+
+static int bench_create_file(const char *path) {
+    char data[BENCH_FILE_SIZE];
+    int fd;
+
+    memset(data, 'x', sizeof(data));
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+        write_all(fd, data, sizeof(data)) < 0) {
+        fprintf(stderr,
+                "Couldn't create '%s': '%s'\n",
+                path,
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+
+    return 0;
+}
+
+/* Run the operations on every file in turn until asked to stop. Without
+ * 'o' files stay open for the whole run. */
+static void *bench_thread(void *arg) {
+    bench_thread_t *thread = arg;
+    char path[PATH_MAX];
+    char data[64];
+    int reopen = strchr(bench_ops, 'o') != NULL;
+    int *fds;
+    const char *op;
+    int i;
+
+    if ((fds = calloc(bench_n_files, sizeof(int))) == NULL)
+        return NULL;
+
+    for (i = 0; i < bench_n_files; i++) {
+        bench_file_path(path, sizeof(path), thread->index, i);
+        fds[i] = reopen ? -1 : open(path, O_RDWR | O_CLOEXEC);
+    }
+
+    memset(data, 'y', sizeof(data));
+    while (!atomic_load_explicit(&bench_stop, memory_order_relaxed)) {
+        for (i = 0; i < bench_n_files; i++) {
+            if (reopen) {
+                bench_file_path(path, sizeof(path), thread->index, i);
+                fds[i] = open(path, O_RDWR | O_CLOEXEC);
+            }
+            if (fds[i] < 0)
+                continue;
+
+            for (op = bench_ops; *op != '\0'; op++) {
+                if (*op == 'r' && pread(fds[i], data, sizeof(data), 0) < 0)
+                    break;
+                if (*op == 'w' && pwrite(fds[i], data, sizeof(data), 0) < 0)
+                    break;
+                thread->ops++;
+            }
+
+            if (reopen) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+    }
+
+    for (i = 0; i < bench_n_files; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    free(fds);
+
+    return NULL;
+}
+
+/* Body of the probe process: read one byte, wait for the benchmark to see
+ * the access, repeat */
+static void bench_probe(void) {
+    char path[PATH_MAX];
+    char byte;
+    uint64_t sent;
+    unsigned long seq;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/probe", bench_dir);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        _exit(EXIT_FAILURE);
+
+    while (!atomic_load(&probe->stop)) {
+        sent = bench_now();
+        atomic_store(&probe->sent, sent);
+        seq = atomic_fetch_add(&probe->seq, 1) + 1;
+        if (pread(fd, &byte, 1, 0) < 0)
+            break;
+
+        while (atomic_load(&probe->acked) != seq &&
+               !atomic_load(&probe->stop) &&
+               bench_now() - sent < BENCH_PROBE_TIMEOUT)
+            usleep(10);
+        usleep(BENCH_PROBE_INTERVAL);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+/* Process a batch, recording the latency of the probe it carries */
+static void bench_batch_process(char *buffer, ssize_t length) {
+    struct fanotify_event_metadata *metadata;
+    ssize_t left = length;
+    unsigned long seq = 0;
+
+    metadata = (struct fanotify_event_metadata *) buffer;
+    while (FAN_EVENT_OK (metadata, left)) {
+        if (metadata->pid == probe_pid && (metadata->mask & FAN_ACCESS)) {
+            seq = atomic_load(&probe->seq);
+            if (seq == atomic_load(&probe->acked))
+                seq = 0;
+        }
+        metadata = FAN_EVENT_NEXT (metadata, left);
+    }
+
+    event_batch_process(buffer, length);
+
+    if (seq != 0) {
+        if (n_latencies < BENCH_MAX_PROBES)
+            latencies[n_latencies++] = bench_now() - atomic_load(&probe->sent);
+        atomic_store(&probe->acked, seq);
+    }
+}
+
+/* Read and process events until the queue is empty */
+static void bench_read_events(int fanotify_fd) {
+    ssize_t length;
+
+    for (;;) {
+        if ((length = read(fanotify_fd, fanotify_buffer, fanotify_buffer_size)) <= 0) {
+            if (length < 0 && errno == EAGAIN)
+                event_queue_drained();
+            return;
+        }
+
+        bench_batch_process(fanotify_buffer, length);
+
+        if (queue_cap > 0)
+            fanotify_cap_queue(fanotify_fd);
+    }
+}
+
+static int bench_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(double percentile) {
+    size_t i = (size_t) (percentile / 100.0 * n_latencies);
+
+    if (i >= n_latencies)
+        i = n_latencies - 1;
+
+    return latencies[i] / 1000.0;
+}
+
+static void bench_cleanup(int n_threads) {
+    char path[PATH_MAX];
+    int i;
+    int j;
+
+    for (i = 0; i < n_threads; i++) {
+        for (j = 0; j < bench_n_files; j++) {
+            bench_file_path(path, sizeof(path), i, j);
+            unlink(path);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/probe", bench_dir);
+    unlink(path);
+    rmdir(bench_dir);
+}
+
+static void print_bench_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Options:\n"
+            "  -T, --threads=N       Number of threads generating events\n"
+            "                        (default: %d)\n"
+            "  -n, --files=N         Number of files per thread (default: %d)\n"
+            "  -O, --ops=OPS         Operations on each file, in order: o to open\n"
+            "                        and close it around the others, r to read,\n"
+            "                        w to write (default: %s)\n"
+            "  -D, --duration=S      Seconds to generate events for (default: %d)\n"
+            "  -f, --fid             Report file handles instead of opening files\n"
+            "  -b, --buffer-size=N   Size of the event read buffer, K/M/G suffixes\n"
+            "                        allowed (default: %d)\n"
+            "  -B, --binary          Write a binary log instead of text\n"
+            "  -j, --json            Write NDJSON instead of text\n"
+            "  -U, --unlimited-queue=N\n"
+            "                        Use an unlimited queue capped at N bytes\n"
+            "  -o, --output=FILE     Write events to FILE (default: /dev/null)\n"
+            "  -h, --help            Show this help\n",
+            program,
+            BENCH_THREADS,
+            BENCH_FILES,
+            BENCH_OPS,
+            BENCH_DURATION,
+            FANOTIFY_BUFFER_SIZE);
+}
+
+int main(int argc,
+         const char **argv) {
+    static const struct option long_options[] = {
+        {"threads",        required_argument, NULL, 'T'},
+        {"files",          required_argument, NULL, 'n'},
+        {"ops",            required_argument, NULL, 'O'},
+        {"duration",       required_argument, NULL, 'D'},
+        {"fid",            no_argument, NULL, 'f'},
+        {"buffer-size",    required_argument, NULL, 'b'},
+        {"binary",         no_argument, NULL, 'B'},
+        {"json",           no_argument, NULL, 'j'},
+        {"unlimited-queue", required_argument, NULL, 'U'},
+        {"output",         required_argument, NULL, 'o'},
+        {"help",           no_argument, NULL, 'h'},
+        {NULL, 0,                       NULL, 0}
+    };
+    static string_table_t strings;
+    char dir[] = "/tmp/fanotify-bench.XXXXXX";
+    char path[PATH_MAX];
+    bench_thread_t *threads;
+    struct pollfd fds;
+    unsigned long long n_ops = 0;
+    uint64_t start;
+    uint64_t stopped = 0;
+    uint64_t end;
+    int n_threads = BENCH_THREADS;
+    int duration = BENCH_DURATION;
+    int fanotify_fd;
+    int option;
+    int error;
+    int i;
+    int j;
+
+    while ((option = getopt_long(argc, (char *const *) argv, "T:n:O:D:fb:BjU:o:h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'T':
+            if ((n_threads = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid number of threads '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            if ((bench_n_files = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid number of files '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'O':
+            if (optarg[strspn(optarg, "orw")] != '\0') {
+                fprintf(stderr, "Invalid operations '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            bench_ops = optarg;
+            break;
+        case 'D':
+            if ((duration = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid duration '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            use_fid = 1;
+            break;
+        case 'b':
+            fanotify_buffer_size = parse_size(optarg);
+            if (fanotify_buffer_size < FANOTIFY_BUFFER_SIZE_MIN ||
+                fanotify_buffer_size > FANOTIFY_BUFFER_SIZE_MAX) {
+                fprintf(stderr, "Invalid buffer size '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            use_binary = 1;
+            break;
+        case 'j':
+            use_json = 1;
+            break;
+        case 'U':
+            if ((queue_cap = parse_size(optarg)) == 0) {
+                fprintf(stderr, "Invalid queue cap '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            file_sink.path = optarg;
+            break;
+        case 'h':
+            print_bench_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            print_bench_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (use_binary && use_json) {
+        fprintf(stderr, "Binary and JSON output can't be combined\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (file_sink.path == NULL)
+        file_sink.path = "/dev/null";
+
+    /* The queue is read until empty, as in drain mode */
+    use_drain = 1;
+
+    if ((bench_dir = mkdtemp(dir)) == NULL) {
+        fprintf(stderr,
+                "Couldn't create temporary directory: '%s'\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Files exist before the marks, their creation is not measured */
+    for (i = 0; i < n_threads; i++) {
+        for (j = 0; j < bench_n_files; j++) {
+            bench_file_path(path, sizeof(path), i, j);
+            if (bench_create_file(path) < 0)
+                exit(EXIT_FAILURE);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/probe", bench_dir);
+    if (bench_create_file(path) < 0)
+        exit(EXIT_FAILURE);
+
+    if ((latencies = malloc(BENCH_MAX_PROBES * sizeof(*latencies))) == NULL ||
+        (threads = calloc(n_threads, sizeof(*threads))) == NULL) {
+        fprintf(stderr, "Couldn't allocate benchmark state\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((probe = mmap(NULL,
+                      sizeof(*probe),
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS,
+                      -1,
+                      0)) == MAP_FAILED) {
+        fprintf(stderr,
+                "Couldn't allocate probe state: '%s'\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (initialize_event_buffer() < 0) {
+        fprintf(stderr, "Couldn't initialize event buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_cache_init(&pid_cache, 0, 1);
+
+    if ((fanotify_fd = initialize_fanotify(1, &bench_dir)) < 0) {
+        fprintf(stderr, "Couldn't initialize fanotify-cmdline\n");
+        exit(EXIT_FAILURE);
+    }
+    fflush(stdout);
+
+    if (initialize_file_sink() < 0) {
+        fprintf(stderr, "Couldn't initialize output file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (use_binary)
+        output.strings = &strings;
+
+    if ((probe_pid = fork()) < 0) {
+        fprintf(stderr,
+                "Couldn't fork probe: '%s'\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (probe_pid == 0)
+        bench_probe();
+
+    start = bench_now();
+    for (i = 0; i < n_threads; i++) {
+        threads[i].index = i;
+        if ((error = pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i])) != 0) {
+            fprintf(stderr,
+                    "Couldn't create thread: '%s'\n",
+                    strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Process events during the storm, then until none are left */
+    fds.fd = fanotify_fd;
+    fds.events = POLLIN;
+    for (;;) {
+        if (poll(&fds, 1, 100) < 0 && errno != EINTR) {
+            fprintf(stderr,
+                    "Couldn't poll(): '%s'\n",
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (fds.revents & POLLIN)
+            bench_read_events(fanotify_fd);
+        else if (stopped != 0)
+            break;
+
+        if (stopped == 0 && bench_now() - start >= (uint64_t) duration * 1000000000ULL) {
+            atomic_store(&bench_stop, 1);
+            for (i = 0; i < n_threads; i++) {
+                pthread_join(threads[i].thread, NULL);
+                n_ops += threads[i].ops;
+            }
+            atomic_store(&probe->stop, 1);
+            waitpid(probe_pid, NULL, 0);
+            stopped = bench_now();
+        }
+    }
+    end = bench_now();
+
+    output_flush(&output);
+    shutdown_file_sink();
+    shutdown_fanotify(fanotify_fd);
+    shutdown_event_buffer();
+    bench_cleanup(n_threads);
+
+    printf("Generated %llu operations in %.2f s (%.0f ops/s)\n",
+           n_ops,
+           (stopped - start) / 1e9,
+           n_ops / ((stopped - start) / 1e9));
+    printf("Processed %llu events in %.2f s (%.0f events/s), %llu reads, max %llu events per read\n",
+           (unsigned long long) read_stats.events,
+           (end - start) / 1e9,
+           read_stats.events / ((end - start) / 1e9),
+           (unsigned long long) read_stats.reads,
+           (unsigned long long) read_stats.max_events);
+    printf("Queue overflowed %llu times, %llu events dropped by the queue cap\n",
+           (unsigned long long) read_stats.overflows,
+           (unsigned long long) read_stats.dropped);
+    if (n_latencies > 0) {
+        qsort(latencies, n_latencies, sizeof(*latencies), bench_compare);
+        printf("Latency over %zu probes (us): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+               n_latencies,
+               bench_percentile(50),
+               bench_percentile(90),
+               bench_percentile(99),
+               latencies[n_latencies - 1] / 1000.0);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,306 @@
+/* Checks of the formatting and matching code, run in isolation from the
+ * kernel queue */
+#define FANOTIFY_CMDLINE_NO_MAIN
+#include "fanotify-cmdline.c"
+
+/* A check returns its number of failures */
+typedef struct {
+  const char *name;
+  int (*run)(void);
+} check_t;
+
+#define CHECK(condition) \
+    check_report((condition), #condition, __LINE__)
+
+static int check_report(int passed, const char *condition, int line) {
+    if (!passed)
+        fprintf(stderr, "fanotify-check.c:%d: '%s' failed\n", line, condition);
+
+    return !passed;
+}
+
+/* Compare the formatted records with the expected ones */
+static int check_output(const output_t *out, const char *expected, size_t len, int line) {
+    if (out->len == len && memcmp(out->data, expected, len) == 0)
+        return 0;
+
+    fprintf(stderr,
+            "fanotify-check.c:%d: got '%.*s', expected '%.*s'\n",
+            line,
+            (int) out->len,
+            out->data,
+            (int) len,
+            expected);
+    return 1;
+}
+
+#define CHECK_OUTPUT(out, expected, len) \
+    check_output((out), (expected), (len), __LINE__)
+
+static output_t check_expected;
+
+/* Binary records read back as the text records of the same events */
+static int check_binary_round_trip(void) {
+    static const char cmdline[] = "cat\0-n\0/etc/hostname";
+    static string_table_t strings;
+    static output_t binary;
+    char buffer[OUTPUT_RECORD_MAX_SIZE];
+    binary_record_t *record;
+    size_t offset;
+    int failures = 0;
+
+    binary.strings = &strings;
+    binary.batch.realtime.tv_sec = 1700000000;
+    binary.batch.realtime.tv_nsec = 123456789;
+    binary.batch.monotonic.tv_sec = 42;
+    binary.batch.monotonic.tv_nsec = 1;
+    check_expected.batch = binary.batch;
+    use_timing = 1;
+
+    output_append_binary_event(&binary, 1234, FAN_OPEN | FAN_CLOSE_NOWRITE,
+                               "/etc/hostname", cmdline, sizeof(cmdline) - 1, 5000, 1);
+    output_append_event(&check_expected, 1234, FAN_OPEN | FAN_CLOSE_NOWRITE,
+                        "/etc/hostname", cmdline, sizeof(cmdline) - 1, 5000, 1);
+
+    /* Strings already defined are referred to by ID */
+    output_append_binary_event(&binary, 1234, FAN_MODIFY,
+                               "/etc/hostname", cmdline, sizeof(cmdline) - 1, 7, 3);
+    output_append_event(&check_expected, 1234, FAN_MODIFY,
+                        "/etc/hostname", cmdline, sizeof(cmdline) - 1, 7, 3);
+    failures += CHECK(strings.n_entries == 2);
+
+    /* Unknown cmdline and path */
+    output_append_binary_event(&binary, 1, FAN_ACCESS, NULL, NULL, 0, 0, 1);
+    output_append_event(&check_expected, 1, FAN_ACCESS, "unknown", "unknown", 7, 0, 1);
+
+    for (offset = 0; offset + sizeof(*record) <= binary.len; offset += record->len) {
+        record = (binary_record_t *) (binary.data + offset);
+        failures += CHECK(record->len % 8 == 0);
+        if (CHECK(record->len >= sizeof(*record) && record->len <= sizeof(buffer)))
+            return failures + 1;
+        memcpy(buffer, record, record->len);
+        decode_binary_record((binary_record_t *) buffer);
+    }
+    failures += CHECK(offset == binary.len);
+    failures += CHECK_OUTPUT(&output, check_expected.data, check_expected.len);
+
+    use_timing = 0;
+    output.len = 0;
+    check_expected.len = 0;
+    return failures;
+}
+
+/* Format a string alone into the expected output */
+#define CHECK_JSON_STRING(string, expected) \
+    (check_expected.len = 0, \
+     output_append_json_string(&check_expected, (string), sizeof(string) - 1), \
+     CHECK_OUTPUT(&check_expected, (expected), sizeof(expected) - 1))
+
+#define CHECK_BASE64(string, expected) \
+    (check_expected.len = 0, \
+     output_append_base64(&check_expected, (string), sizeof(string) - 1), \
+     CHECK_OUTPUT(&check_expected, (expected), sizeof(expected) - 1))
+
+/* JSON strings are valid UTF-8, other bytes are escaped */
+static int check_json_escape(void) {
+    static const char path[] = "/tmp/\xff\x01";
+    static const char expected[] =
+        "{\"realtime_ns\":1000000002,\"monotonic_ns\":3,\"lag_ns\":4,\"pid\":5,"
+        "\"events\":[\"FAN_MODIFY\"],\"count\":1,"
+        "\"path\":\"/tmp/\\u00ff\\u0001\",\"path_bytes\":\"L3RtcC//AQ==\","
+        "\"argv\":[\"sh\",\"-c\",\"\\u00e9\"],\"argv_bytes\":[\"c2g=\",\"LWM=\",\"6Q==\"]}\n";
+    int failures = 0;
+
+    failures += CHECK_JSON_STRING("/etc/hostname", "\"/etc/hostname\"");
+    failures += CHECK_JSON_STRING("a\"b\\c\nd\te", "\"a\\\"b\\\\c\\nd\\te\"");
+    failures += CHECK_JSON_STRING("\x01\x1f\x7f", "\"\\u0001\\u001f\x7f\"");
+    failures += CHECK_JSON_STRING("caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80", "\"caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80\"");
+
+    /* Stray, overlong, surrogate and truncated sequences */
+    failures += CHECK_JSON_STRING("\xff\x80", "\"\\u00ff\\u0080\"");
+    failures += CHECK_JSON_STRING("\xc0\xaf", "\"\\u00c0\\u00af\"");
+    failures += CHECK_JSON_STRING("\xed\xa0\x80", "\"\\u00ed\\u00a0\\u0080\"");
+    failures += CHECK_JSON_STRING("a\xe2\x82", "\"a\\u00e2\\u0082\"");
+
+    failures += CHECK(utf8_valid("caf\xc3\xa9", 5));
+    failures += CHECK(utf8_valid("\xf4\x8f\xbf\xbf", 4));
+    failures += CHECK(!utf8_valid("\xf4\x90\x80\x80", 4));
+    failures += CHECK(!utf8_valid("\xe0\x80\x80", 3));
+    failures += CHECK(!utf8_valid("\xc3", 1));
+
+    failures += CHECK_BASE64("", "\"\"");
+    failures += CHECK_BASE64("f", "\"Zg==\"");
+    failures += CHECK_BASE64("fo", "\"Zm8=\"");
+    failures += CHECK_BASE64("foo", "\"Zm9v\"");
+    failures += CHECK_BASE64("foob", "\"Zm9vYg==\"");
+    failures += CHECK_BASE64("\xff\xfe\xfd", "\"//79\"");
+
+    /* The exact bytes are given besides when a value is not UTF-8 */
+    check_expected.len = 0;
+    check_expected.batch.realtime.tv_sec = 1;
+    check_expected.batch.realtime.tv_nsec = 2;
+    check_expected.batch.monotonic.tv_sec = 0;
+    check_expected.batch.monotonic.tv_nsec = 3;
+    output_append_json_event(&check_expected, 5, FAN_MODIFY, path, "sh\0-c\0\xe9", 7, 4, 1);
+    failures += CHECK_OUTPUT(&check_expected, expected, sizeof(expected) - 1);
+
+    check_expected.len = 0;
+    return failures;
+}
+
+/* Whether a path is reported under the rules of check_path_filter */
+static const struct {
+  const char *path;
+  int accepted;
+} check_paths[] = {
+  {"/home/user/src", 1},
+  {"/home/user/src/main.c", 1},
+  {"/home/user/srcs/main.c", 0},
+  {"/home/user/src/build", 0},
+  {"/home/user/src/build/main.o", 0},
+  {"/home/user/src/builder.c", 1},
+  {"/home/user/src/.main.c.swp", 0},
+  {"/home/user/src/node_modules/a.js", 0},
+  {"/home/user/src/web/node_modules/a/b.js", 0},
+  {"/home/user/src/gen/a.c", 0},
+  {"/home/user/src/x/y/gen/a.h", 0},
+  {"/home/user/src/gen/a.cc", 1},
+  {"/home/user/src/gen/sub/a.c", 1},
+  {"/home/user/src/z.c", 0},
+  {"/home/user/src/*", 0},
+  {"/home/user/src/a", 1},
+  {"/var/log/syslog.log", 1},
+  {"/var/log/apt/history.log", 0},
+  {"/opt/v1/bin", 1},
+  {"/opt/vx/bin", 0},
+  {"/opt/v1/bin/ls", 0},
+  {"/etc/passwd", 0},
+};
+
+/* Prefixes and globs, through the DFA and simulated */
+static int check_path_filter(void) {
+    size_t i;
+    int failures = 0;
+    int pass;
+
+    path_filter_add("/home/user/src/", PATH_FILTER_INCLUDE);
+    path_filter_add("/var/log/*.log", PATH_FILTER_INCLUDE);
+    path_filter_add("/opt/v[0-9]/bin", PATH_FILTER_INCLUDE);
+    path_filter_add("/home/user/src/build", PATH_FILTER_DROP);
+    path_filter_add("*.swp", PATH_FILTER_DROP);
+    path_filter_add("**/node_modules/**", PATH_FILTER_DROP);
+    path_filter_add("/home/user/src/**/gen/*.[ch]", PATH_FILTER_DROP);
+    path_filter_add("/home/user/src/[!a-m]*.c", PATH_FILTER_DROP);
+    path_filter_add("/home/user/src/\\*", PATH_FILTER_DROP);
+    if (CHECK(path_filter_compile() == 0) || CHECK(path_filter.dfa != NULL))
+        return 1;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < sizeof(check_paths) / sizeof(check_paths[0]); ++i) {
+            if (path_filter_accepts(check_paths[i].path) == check_paths[i].accepted)
+                continue;
+            fprintf(stderr,
+                    "fanotify-check.c: '%s' %s%s\n",
+                    check_paths[i].path,
+                    check_paths[i].accepted ? "dropped" : "accepted",
+                    path_filter.dfa != NULL ? "" : " without the DFA");
+            failures++;
+        }
+        failures += CHECK(!path_filter_accepts(NULL));
+
+        /* As when there are too many states for a DFA */
+        free(path_filter.dfa);
+        path_filter.dfa = NULL;
+    }
+
+    return failures;
+}
+
+/* Repeated reads and writes make a single record */
+static int check_coalesce(void) {
+    static const char cmdline[] = "dd\0if=/dev/zero";
+    static output_t out;
+    uint64_t first;
+    int failures = 0;
+
+    coalesce.window = 1000000;
+    use_timing = 1;
+    out.batch.realtime.tv_sec = 1700000000;
+    out.batch.monotonic.tv_sec = 100;
+    check_expected.len = 0;
+    check_expected.batch = out.batch;
+    first = coalesce_now(&out);
+
+    failures += CHECK(coalesce_event(&out, 10, FAN_ACCESS, "/a", cmdline, sizeof(cmdline) - 1, 50) == 1);
+    failures += CHECK(coalesce_event(&out, 11, FAN_MODIFY, "/a", NULL, 0, 60) == 1);
+
+    /* Records carry the read time of their first event */
+    out.batch.realtime.tv_nsec = 500;
+    out.batch.monotonic.tv_nsec = 500;
+    failures += CHECK(coalesce_event(&out, 10, FAN_ACCESS, "/a", cmdline, sizeof(cmdline) - 1, 70) == 1);
+    failures += CHECK(coalesce_event(&out, 10, FAN_MODIFY, "/a", cmdline, sizeof(cmdline) - 1, 80) == 1);
+    failures += CHECK(out.len == 0 && out.coalesced.n_entries == 2);
+
+    /* A close ends the record */
+    failures += CHECK(coalesce_event(&out, 10, FAN_CLOSE_WRITE, "/a", cmdline, sizeof(cmdline) - 1, 90) == 1);
+    output_append_event(&check_expected, 10, FAN_ACCESS | FAN_MODIFY | FAN_CLOSE_WRITE,
+                        "/a", cmdline, sizeof(cmdline) - 1, 50, 4);
+    failures += CHECK_OUTPUT(&out, check_expected.data, check_expected.len);
+    failures += CHECK(read_stats.coalesced == 3);
+
+    /* Anything else writes the pending record out first, and itself alone */
+    failures += CHECK(coalesce_event(&out, 12, FAN_ACCESS, "/b", NULL, 0, 100) == 1);
+    failures += CHECK(coalesce_event(&out, 12, FAN_OPEN, "/b", NULL, 0, 110) == 0);
+    check_expected.batch = out.batch;
+    output_append_event(&check_expected, 12, FAN_ACCESS, "/b", "unknown", 7, 100, 1);
+    failures += CHECK_OUTPUT(&out, check_expected.data, check_expected.len);
+    failures += CHECK(coalesce_event(&out, 12, FAN_OPEN, "/c", NULL, 0, 120) == 0);
+
+    /* The other process' record once its window elapsed */
+    coalesce_expire(&out, first + coalesce.window - 1);
+    failures += CHECK(out.coalesced.n_entries == 1);
+    coalesce_expire(&out, first + coalesce.window);
+    check_expected.batch.realtime.tv_nsec = 0;
+    check_expected.batch.monotonic.tv_nsec = 0;
+    output_append_event(&check_expected, 11, FAN_MODIFY, "/a", "unknown", 7, 60, 1);
+    failures += CHECK_OUTPUT(&out, check_expected.data, check_expected.len);
+    failures += CHECK(out.coalesced.n_entries == 0);
+
+    coalesce.window = 0;
+    use_timing = 0;
+    check_expected.len = 0;
+    return failures;
+}
+
+static const check_t checks[] = {
+  {"binary_round_trip", check_binary_round_trip},
+  {"json_escape", check_json_escape},
+  {"path_filter", check_path_filter},
+  {"coalesce", check_coalesce},
+};
+
+int main(int argc,
+         const char **argv) {
+    const check_t *check;
+    size_t i;
+    int failures = 0;
+    int failed;
+    int j;
+
+    for (i = 0; i < sizeof(checks) / sizeof(checks[0]); ++i) {
+        check = &checks[i];
+
+        /* Only the checks named, if any */
+        if (argc > 1) {
+            for (j = 1; j < argc && strcmp(argv[j], check->name) != 0; j++);
+            if (j == argc)
+                continue;
+        }
+
+        failed = check->run();
+        printf("%-24s %s\n", check->name, failed ? "FAILED" : "ok");
+        failures += failed;
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
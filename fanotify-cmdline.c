@@ -4,33 +4,79 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <poll.h>
 #include <errno.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/statfs.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/fanotify.h>
 #include <fcntl.h>
 #include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <zlib.h>
+#include <pwd.h>
+#include <regex.h>
 
 #include <linux/fanotify.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <linux/io_uring.h>
+
+/* Set up, tear down and option helpers of main(). The benchmarks include
+ * this file without main(): the helpers stay compiled there, so that the
+ * globals they set aren't folded into constants in the code measured. */
+#ifdef FANOTIFY_CMDLINE_NO_MAIN
+#define MAIN_HELPER __attribute__((used))
+#else
+#define MAIN_HELPER
+#endif
 
 /* Structure to keep track of monitored directories */
 typedef struct {
   /* Path of the directory */
   char *path;
+  /* FD of the directory, used as mount FD to open file handles */
+  int dir_fd;
+  /* ID of the filesystem the directory lives in */
+  fsid_t fsid;
+  /* Events reported on the directory and its files */
+  uint64_t mask;
 } monitored_t;
 
-/* Size of buffer to use when reading fanotify-cmdline events */
+/* Default size of buffer to use when reading fanotify-cmdline events */
 #define FANOTIFY_BUFFER_SIZE 8192
 
+/* Limits for a user provided buffer size */
+#define FANOTIFY_BUFFER_SIZE_MIN 4096
+#define FANOTIFY_BUFFER_SIZE_MAX (1024 * 1024 * 1024)
+
+/* Size of huge pages to back large buffers with */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 /* Enumerate list of FDs to poll */
 enum {
   FD_POLL_SIGNAL = 0,
   FD_POLL_FANOTIFY,
+  FD_POLL_PROC,
+  FD_POLL_TIMER,
+  FD_POLL_REAP,
   FD_POLL_MAX
 };
 
-/* Setup fanotify notifications (FAN) mask. All these defined in fanotify.h. */
+/* Setup fanotify notifications (FAN) mask. All these defined in fanotify.h.
+ * Directories given without events of their own get this one. */
 static uint64_t event_mask =
     (FAN_ACCESS |         /* File accessed */
         FAN_MODIFY |         /* File modified */
@@ -44,146 +90,5135 @@ static uint64_t event_mask =
 static monitored_t *monitors;
 static int n_monitors;
 
-static char *get_program_cmdline_from_pid(int pid, char *buffer, size_t buffer_size) {
-    int i;
+/* Paths whose events are ignored in the kernel */
+static const char **excludes;
+static int n_excludes;
+
+/* Maximum number of states of all glob patterns together */
+#define PATH_FILTER_MAX_STATES 1024
+
+/* Maximum number of states of the DFA the globs are turned into, beyond
+ * which their states are simulated instead (must be a power of two) */
+#define PATH_FILTER_MAX_DFA_STATES 4096
+
+/* Rules a path matched */
+#define PATH_FILTER_INCLUDE 0x1
+#define PATH_FILTER_DROP    0x2
+
+/* Node of the prefix trie, children are chained through siblings. Index 0
+ * is the root and never a child, so 0 also means none. */
+typedef struct {
+  uint32_t child;
+  uint32_t sibling;
+  unsigned char byte;
+  /* Rules of the prefix ending here */
+  unsigned char flags;
+} path_trie_node_t;
+
+/* State of the glob automaton. It consumes a byte of its class to move to
+ * the next state, or to stay if it loops; a loop may also be left without
+ * consuming anything, to the next state and, if skip is set, to skip
+ * states ahead. A loop with an empty class only splits. */
+typedef struct {
+  uint64_t class[4];
+  unsigned char loop;
+  unsigned char skip;
+  /* Rules of the glob, on its final state */
+  unsigned char flags;
+} glob_state_t;
+
+/* Filter of resolved paths, applied before looking cmdlines up. Plain
+ * patterns are prefixes matched on component boundaries, in a trie,
+ * others globs matched against the whole path, all of them at once. */
+typedef struct {
+  path_trie_node_t *nodes;
+  uint32_t n_nodes;
+  glob_state_t *states;
+  uint32_t n_states;
+  /* Compiled from the states: sets of states of n_words words, the
+   * initial one, those whose class has each byte, and for every state the
+   * one it reaches when consuming a byte, loops followed */
+  uint32_t n_words;
+  uint64_t *start;
+  uint64_t *byte_states;
+  uint64_t *targets;
+  /* DFA of the sets, NULL if too large: next state by state and byte,
+   * state 0 matching nothing anymore and 1 being the initial one, and
+   * rules matched by every state */
+  uint32_t *dfa;
+  unsigned char *dfa_flags;
+  /* Whether only included paths are reported */
+  int has_includes;
+} path_filter_t;
+
+static path_filter_t path_filter;
+
+/* Whether any path filter was given */
+static int use_path_filter;
+
+/* What process rules match on */
+enum {
+  PROCESS_RULE_EXE = 0, /* Executable path, or name without a '/' */
+  PROCESS_RULE_CMDLINE, /* Regex on arguments joined by spaces */
+  PROCESS_RULE_UID,     /* Owner of /proc/<pid> */
+  PROCESS_RULE_CGROUP,  /* Prefix of the cgroup path */
+  PROCESS_RULE_TREE,    /* Process or one of its descendants */
+  PROCESS_RULE_MAX
+};
+
+typedef struct {
+  int kind;
+  /* PATH_FILTER_INCLUDE or PATH_FILTER_DROP */
+  int flags;
+  const char *value;
+  regex_t regex;
+  long number;
+} process_rule_t;
+
+/* Filter of processes, evaluated once per process and cached with its
+ * cmdline */
+typedef struct {
+  process_rule_t *rules;
+  int n_rules;
+  int has_includes;
+} process_filter_t;
+
+static process_filter_t process_filter;
+
+/* Maximum depth of the process tree walked up by tree rules */
+#define PROCESS_TREE_MAX_DEPTH 64
+
+/* PID of this very process, whose events are dropped, 0 to keep them */
+static int self_pid;
+
+/* Number of slots in the PID cmdline cache (must be a power of two) */
+#define PID_CACHE_SIZE 8192
+
+/* Maximum number of processes kept in the cache when validating through
+ * /proc. Each one holds an open /proc/<pid>/stat FD, so keep it well below
+ * the usual FD limit. */
+#define PID_CACHE_MAX_ENTRIES 256
+
+/* Maximum number of processes kept in the cache when fed by the proc
+ * connector, no FDs are held then */
+#define PID_CACHE_MAX_LIVE_ENTRIES (PID_CACHE_SIZE / 2)
+
+/* Seconds between checks for exited processes to drop while the
+ * monitored directories are idle */
+#define PID_CACHE_REAP_INTERVAL 1
+
+/* Maximum number of exited processes kept aside once their PID got
+ * reused, until their queued events are processed */
+#define PID_CACHE_MAX_SUPERSEDED 16
+
+/* Number of process filter verdicts kept for processes without a cache
+ * entry (must be a power of two) */
+#define PROCESS_VERDICT_SIZE 256
+
+/* Size of buffer to use when reading /proc/<pid>/stat */
+#define PID_STAT_BUFFER_SIZE 1024
+
+/* Size of buffer to use when reading proc connector messages */
+#define PROC_CONNECTOR_BUFFER_SIZE 8192
+
+/* Cached cmdline of a single process */
+typedef struct {
+  /* PID of the process, 0 if the slot is free */
+  int pid;
+  /* Open /proc/<pid>/stat, pins the process: reads fail once it exits.
+   * -1 when the entry is maintained by the proc connector. */
+  int stat_fd;
+  /* Set once the proc connector reported the exit of the process */
+  int exited;
+  /* Process start time, together with the PID identifies the process */
+  unsigned long long start_time;
+  /* Location of argv in the process memory, changes on every exec */
+  unsigned long arg_start;
+  unsigned long arg_end;
+  /* Read batch in which the entry was last validated, or in which the
+   * process exited */
+  unsigned long generation;
+  /* Cmdline of the process, arguments NUL separated */
+  char *cmdline;
+  size_t cmdline_len;
+  /* Whether the process filter keeps (1) or drops (-1) the events of the
+   * process, 0 until evaluated */
+  int verdict;
+  /* Set when used since the eviction hand last went past the entry */
+  int referenced;
+} pid_cache_entry_t;
+
+/* Process filter verdict of a process that has no cache entry, such as
+ * one that exited before its cmdline could be read */
+typedef struct {
+  int pid;
+  int verdict;
+  /* Read batch the verdict holds for, the PID may be reused later */
+  unsigned long generation;
+} process_verdict_t;
+
+/* Open-addressing hash table of cmdlines keyed by PID */
+typedef struct {
+  pid_cache_entry_t slots[PID_CACHE_SIZE];
+  /* Direct-mapped by PID */
+  process_verdict_t verdicts[PROCESS_VERDICT_SIZE];
+  int n_entries;
+  int max_entries;
+  /* Set when entries are kept up to date by the proc connector */
+  int live;
+  /* Exited processes waiting for their queued events to be processed */
+  int n_exited;
+  /* Exited processes whose PID got reused by the time they were waiting,
+   * oldest first. The PID alone doesn't tell them apart. */
+  pid_cache_entry_t superseded[PID_CACHE_MAX_SUPERSEDED];
+  int n_superseded;
+  /* Bumped once per read batch */
+  unsigned long generation;
+  /* Next slot the eviction hand looks at */
+  unsigned int hand;
+} pid_cache_t;
+
+static pid_cache_t pid_cache;
+
+/* timerfd of the idle checks, -1 without the proc connector */
+static int reap_timer_fd = -1;
+
+/* A proc connector event as forwarded by the proc connector thread */
+typedef struct {
+  /* Set when netlink messages were lost, nothing else is valid then */
+  int lost;
+  /* Length of the cmdline read on exec, -1 if unknown or not an exec */
+  ssize_t cmdline_len;
+  struct proc_event event;
+  char cmdline[PATH_MAX];
+} proc_record_t;
+
+/* The proc connector socket is read by a thread of its own, which reads
+ * the cmdline of an exec'ed process as soon as it's told about it, even
+ * while the events are busy being processed */
+typedef struct {
+  int netlink_fd;
+  /* SOCK_SEQPACKET pair, one record per packet, read from the first */
+  int fds[2];
+  int stop_fd;
+  pthread_t thread;
+} proc_connector_t;
+
+static proc_connector_t proc_connector = {.netlink_fd = -1, .fds = {-1, -1}, .stop_fd = -1};
+
+/* Number of slots in the directory handle cache (must be a power of two) */
+#define FID_CACHE_SIZE 1024
+
+/* Maximum number of directories kept in the cache */
+#define FID_CACHE_MAX_ENTRIES (FID_CACHE_SIZE / 2)
+
+/* Cached path of a directory reported by file handle */
+typedef struct {
+  /* Path of the directory, NULL if the slot is free */
+  char *path;
+  /* Hash of the key below */
+  unsigned int hash;
+  /* Filesystem and file handle identifying the directory */
+  __kernel_fsid_t fsid;
+  int handle_type;
+  unsigned int handle_bytes;
+  unsigned char handle[MAX_HANDLE_SZ];
+  /* Set when used since the eviction hand last went past the entry, by
+   * lookups holding the lock for reading only */
+  _Atomic int referenced;
+} fid_cache_entry_t;
+
+/* Open-addressing hash table of directory paths keyed by file handle,
+ * shared by all worker threads */
+typedef struct {
+  fid_cache_entry_t slots[FID_CACHE_SIZE];
+  int n_entries;
+  /* Next slot the eviction hand looks at */
+  unsigned int hand;
+  pthread_rwlock_t lock;
+} fid_cache_t;
+
+static fid_cache_t fid_cache = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+/* Whether to keep the process table with the kernel proc connector */
+static int use_proc_connector;
+
+/* Whether events report file handles instead of open FDs */
+static int use_fid;
+
+/* Whether to keep reading until the queue is empty on every wakeup */
+static int use_drain;
+
+/* Maximum number of reads per wakeup when draining, so that signals and
+ * the other FDs polled are still served under sustained load */
+#define DRAIN_MAX_READS 64
+
+/* Buffer to read fanotify events into */
+static char *fanotify_buffer;
+static size_t fanotify_buffer_size = FANOTIFY_BUFFER_SIZE;
+
+/* Statistics about read() batches, also read by the metrics thread */
+typedef struct {
+  _Atomic unsigned long long reads;
+  _Atomic unsigned long long events;
+  _Atomic unsigned long long max_events;
+  /* Queue overflows, reported by the kernel or by the queue cap */
+  _Atomic unsigned long long overflows;
+  /* Events discarded to keep an unlimited queue under its cap */
+  _Atomic unsigned long long dropped;
+  /* Events not reported because of the path filter */
+  _Atomic unsigned long long filtered;
+  /* Events not reported because of the process filter, or our own */
+  _Atomic unsigned long long process_filtered;
+  /* Events merged into the record of an earlier one */
+  _Atomic unsigned long long coalesced;
+} read_stats_t;
+
+static read_stats_t read_stats;
+
+/* With an unlimited kernel queue, maximum bytes of events left queued */
+static size_t queue_cap;
+
+/* Number of buckets of a histogram, bucket i counts values up to 2^i and
+ * the last one everything else */
+#define HISTOGRAM_BUCKETS 32
+
+/* Default interval between two writes of the metrics file, in seconds */
+#define METRICS_INTERVAL 10
+
+/* Lock-free histogram with power of two buckets, updated by any thread */
+typedef struct {
+  const char *name;
+  const char *help;
+  /* Factor from recorded values to exported ones */
+  double scale;
+  _Atomic unsigned long long buckets[HISTOGRAM_BUCKETS];
+  _Atomic unsigned long long count;
+  _Atomic unsigned long long sum;
+} histogram_t;
+
+/* Instrumented stages */
+enum {
+  METRIC_READ_BATCH = 0, /* Events per read() */
+  METRIC_EVENT_PROCESS,  /* Time to process an event */
+  METRIC_PATH_LOOKUP,    /* Time to resolve the path of an event */
+  METRIC_CMDLINE_LOOKUP, /* Time to get the cmdline of an event */
+  METRIC_OUTPUT_WRITE,   /* Time to flush a chunk of output */
+  METRIC_EVENT_LAG,      /* Time from read() to formatting */
+  METRIC_MAX
+};
+
+static histogram_t histograms[METRIC_MAX] = {
+  [METRIC_READ_BATCH] = {"fanotify_cmdline_read_batch_events", "Events returned by a single read()", 1},
+  [METRIC_EVENT_PROCESS] = {"fanotify_cmdline_event_process_seconds", "Time to process an event", 1e-9},
+  [METRIC_PATH_LOOKUP] = {"fanotify_cmdline_path_lookup_seconds", "Time to resolve the path of an event", 1e-9},
+  [METRIC_CMDLINE_LOOKUP] = {"fanotify_cmdline_cmdline_lookup_seconds", "Time to get the cmdline of an event", 1e-9},
+  [METRIC_OUTPUT_WRITE] = {"fanotify_cmdline_output_write_seconds", "Time to flush a chunk of output", 1e-9},
+  [METRIC_EVENT_LAG] = {"fanotify_cmdline_event_lag_seconds", "Time from reading an event to formatting it", 1e-9},
+};
+
+/* Metrics written periodically to a file, Prometheus text format */
+typedef struct {
+  const char *path;
+  int interval;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+} metrics_t;
+
+static metrics_t metrics = {
+  .interval = METRICS_INTERVAL,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER
+};
+
+/* Whether stages are timed */
+static int use_metrics;
+
+/* Size of the buffer event records are formatted into before being
+ * written out */
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+
+/* Room taken at most by a single record: path, cmdline and fixed parts.
+ * JSON escaping takes up to 6 bytes per input byte, and values that are
+ * not UTF-8 are repeated in base64. */
+#define OUTPUT_RECORD_MAX_SIZE (16 * PATH_MAX + 512)
+
+/* Time a batch of events was read at, shared by all its events */
+typedef struct {
+  struct timespec realtime;
+  struct timespec monotonic;
+} batch_time_t;
+
+/* Number of slots of the string table of a binary log writer (must be a
+ * power of two) */
+#define STRING_TABLE_SIZE 8192
+
+/* Maximum number of interned strings, the table starts over beyond */
+#define STRING_TABLE_MAX_ENTRIES (STRING_TABLE_SIZE / 2)
+
+/* Space for the contents of the interned strings */
+#define STRING_ARENA_SIZE (1024 * 1024)
+
+/* Interned string */
+typedef struct {
+  uint32_t hash;
+  /* ID local to the writer, 0 if the slot is free */
+  uint32_t id;
+  /* Offset of the string in the arena */
+  uint32_t offset;
+} string_entry_t;
+
+/* Strings already defined in the binary log by a writer */
+typedef struct {
+  string_entry_t slots[STRING_TABLE_SIZE];
+  uint32_t n_entries;
+  size_t arena_len;
+  char arena[STRING_ARENA_SIZE];
+} string_table_t;
+
+/* The binary log is a header followed by records */
+#define BINARY_LOG_MAGIC "FACMDLOG"
+#define BINARY_LOG_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+} binary_log_header_t;
+
+/* Types of binary log records */
+enum {
+  BINARY_RECORD_STRING = 1, /* Defines (or redefines) a string ID */
+  BINARY_RECORD_EVENT       /* Single event, referring to string IDs */
+};
+
+/* Header of every binary log record */
+typedef struct {
+  uint32_t type;
+  /* Length of the record including this header, multiple of 8 */
+  uint32_t len;
+} binary_record_t;
+
+/* String definition, the NUL terminated string follows. IDs are made of
+ * the writer (main thread or worker) in the upper half and of an ID local
+ * to the writer in the lower half; 0 stands for an unknown string. */
+typedef struct {
+  binary_record_t header;
+  uint64_t id;
+} binary_string_t;
+
+typedef struct {
+  binary_record_t header;
+  uint64_t realtime_ns;
+  uint64_t monotonic_ns;
+  uint64_t lag_ns;
+  uint64_t mask;
+  uint64_t path_id;
+  uint64_t cmdline_id;
+  int32_t pid;
+  /* Number of events merged into the record, 0 in older logs */
+  uint32_t count;
+} binary_event_t;
+
+/* A capture is a header like the binary log one, then records laid out
+ * the same way: for every read() its raw buffer, followed by what each of
+ * its events (overflows aside) resolved to */
+#define CAPTURE_MAGIC "FACMDCAP"
+#define CAPTURE_VERSION 2
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  /* PID of the capturing process, whose events it dropped, 0 if none */
+  int32_t pid;
+} capture_header_t;
+
+/* Length of a string the lookup failed for */
+#define CAPTURE_UNKNOWN UINT32_MAX
+
+/* Types of capture records */
+enum {
+  CAPTURE_RECORD_BATCH = 1, /* Raw buffer returned by read() */
+  CAPTURE_RECORD_RESOLVED   /* Path and cmdline of the next event */
+};
+
+/* Batch, the raw buffer follows */
+typedef struct {
+  binary_record_t header;
+  uint64_t realtime_ns;
+  uint64_t monotonic_ns;
+  uint32_t length;
+  uint32_t reserved;
+} capture_batch_t;
+
+/* Resolved event, the path then the cmdline follow */
+typedef struct {
+  binary_record_t header;
+  int32_t pid;
+  uint32_t path_len;
+  uint32_t cmdline_len;
+  uint32_t reserved;
+} capture_resolved_t;
+
+/* Capture being written */
+typedef struct {
+  const char *path;
+  FILE *file;
+} capture_t;
+
+static capture_t capture;
+
+/* Capture being replayed instead of reading from fanotify */
+typedef struct {
+  const char *path;
+  char *data;
+  size_t size;
+  /* Next record to take resolved events from */
+  size_t offset;
+  /* Captured read time of the batch being replayed */
+  batch_time_t batch;
+  /* Time the batch was taken from the capture, lags are measured from it */
+  struct timespec start;
+} replay_t;
+
+static replay_t replay;
+
+/* Default and minimum size of the data of the shared memory output ring
+ * (must be a power of two) */
+#define MMAP_RING_SIZE (16 * 1024 * 1024)
+#define MMAP_RING_MIN_SIZE (1024 * 1024)
+
+#define MMAP_RING_MAGIC "FACMDRNG"
+#define MMAP_RING_VERSION 1
+
+/* Size of the header, the data starts right after */
+#define MMAP_RING_HEADER_SIZE 4096
+
+/* Header of the shared memory output ring. The data is a stream of text or
+ * binary log records (without the log header), byte N of it being at
+ * header_size + N % size. The writer never waits for consumers: it first
+ * moves reserve past the chunk it writes, then head once the chunk is
+ * complete. A consumer copies the data between its position and head,
+ * then checks that reserve didn't get more than size past its position
+ * meanwhile; otherwise it lost data and resumes from head, which is always
+ * the start of a chunk. Binary chunks define all the strings they use. */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t size;
+  /* 0 for text, 1 for binary log records */
+  uint32_t format;
+  uint32_t reserved;
+  _Alignas(64) _Atomic uint64_t reserve;
+  _Alignas(64) _Atomic uint64_t head;
+} mmap_ring_header_t;
+
+/* Shared memory ring events are written into instead of stdout */
+typedef struct {
+  const char *path;
+  size_t size;
+  mmap_ring_header_t *header;
+  char *data;
+} mmap_ring_t;
+
+static mmap_ring_t mmap_ring = {.size = MMAP_RING_SIZE};
+
+/* Size of the buffer of the writer thread (must be a power of two) */
+#define WRITER_BUFFER_SIZE (16 * 1024 * 1024)
+
+/* Maximum size of a single write() of the writer thread */
+#define WRITER_BATCH_SIZE (1024 * 1024)
+
+/* What to do with output when the writer buffer is full */
+enum {
+  WRITER_BLOCK = 0,   /* Wait for the writer */
+  WRITER_DROP_OLDEST, /* Make room dropping the oldest chunks */
+  WRITER_DROP_NEWEST, /* Drop the chunk that doesn't fit */
+  WRITER_SPILL        /* Queue chunks in a temporary file */
+};
+
+/* Writer thread, owning the actual write()s to stdout. Flushed output
+ * chunks are queued in its buffer, each behind an 8 byte length. */
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  /* Signaled when a chunk is queued, and when room is made */
+  pthread_cond_t data_ready;
+  pthread_cond_t room_ready;
+  int policy;
+  char *data;
+  uint64_t head;
+  uint64_t tail;
+  int stop;
+  /* Chunks that didn't fit in the buffer, written out after it. Once
+   * anything is spilled, chunks keep going to the file until it's
+   * drained, so that order is kept. */
+  int spill_fd;
+  off_t spill_read;
+  off_t spill_write;
+  unsigned long long dropped_chunks;
+  unsigned long long dropped_bytes;
+  unsigned long long spilled_bytes;
+} writer_t;
+
+static writer_t writer = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .data_ready = PTHREAD_COND_INITIALIZER,
+  .room_ready = PTHREAD_COND_INITIALIZER,
+  .spill_fd = -1
+};
+
+/* Whether output goes through the writer thread */
+static int use_writer;
+
+/* Size of the buffer rotated segments are compressed with */
+#define COMPRESS_BUFFER_SIZE (256 * 1024)
+
+/* Rotated segment waiting for compression */
+typedef struct segment {
+  struct segment *next;
+  char path[];
+} segment_t;
+
+/* Output file, rotated by size or age. Rotated segments are renamed
+ * aside, and gzipped by a background thread if asked to. */
+typedef struct {
+  const char *path;
+  int fd;
+  uint64_t rotate_size;
+  time_t rotate_interval;
+  int compress;
+  /* Current segment */
+  uint64_t size;
+  time_t opened;
+  unsigned int n_rotations;
+  /* Compression queue */
+  pthread_t compressor;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  segment_t *pending;
+  segment_t **pending_tail;
+  int stop;
+} file_sink_t;
+
+static file_sink_t file_sink = {
+  .fd = -1,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .pending_tail = &file_sink.pending
+};
+
+/* Set when every output chunk must define the strings it uses, as readers
+ * may start at any chunk */
+static int strings_per_chunk;
+
+/* Maximum number of records held back by an output, the oldest is
+ * written out to make room */
+#define COALESCE_MAX_ENTRIES 64
+
+/* Events merged into a pending record, anything else closes it */
+#define COALESCE_MASK (FAN_ACCESS | FAN_MODIFY | FAN_ONDIR)
+
+/* Record held back while further events of its process on its file are
+ * merged into it */
+typedef struct {
+  int pid;
+  uint32_t hash;
+  uint64_t mask;
+  unsigned int count;
+  unsigned long long lag;
+  /* Read time of the first event, and when the window started */
+  batch_time_t batch;
+  uint64_t start;
+  char *path;
+  char *cmdline;
+  size_t cmdline_len;
+} coalesce_entry_t;
+
+/* Pending records of an output, oldest first */
+typedef struct {
+  int n_entries;
+  coalesce_entry_t entries[COALESCE_MAX_ENTRIES];
+} coalesce_table_t;
+
+/* Coalescing of repeated reads and writes */
+typedef struct {
+  /* Window in nanoseconds, 0 when disabled */
+  uint64_t window;
+  /* timerfd ticking once per window to write out expired records */
+  int timer_fd;
+} coalesce_t;
+
+static coalesce_t coalesce = {.timer_fd = -1};
+
+/* Records formatted but not written yet. The timestamp starting every
+ * line is only rendered again when the second changes. */
+typedef struct {
+  size_t len;
+  /* Writer number in string IDs of the binary log, and its strings */
+  uint32_t stream;
+  string_table_t *strings;
+  /* Read time of the batch being formatted */
+  batch_time_t batch;
+  time_t time;
+  size_t time_len;
+  char time_string[32];
+  /* Records held back to merge repeated events into */
+  coalesce_table_t coalesced;
+  char data[OUTPUT_BUFFER_SIZE];
+} output_t;
+
+/* Output of the main thread */
+static output_t output;
+
+/* Keeps the write()s of several workers apart */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Event flags and their names in the output, trailing space included */
+#define EVENT_NAME(flag) {flag, #flag " ", sizeof(#flag)}
+static const struct {
+  uint64_t flag;
+  const char *name;
+  size_t len;
+} event_names[] = {
+  EVENT_NAME(FAN_OPEN),
+  EVENT_NAME(FAN_ACCESS),
+  EVENT_NAME(FAN_MODIFY),
+  EVENT_NAME(FAN_CLOSE_WRITE),
+  EVENT_NAME(FAN_CLOSE_NOWRITE),
+  EVENT_NAME(FAN_MOVED_FROM),
+  EVENT_NAME(FAN_MOVED_TO),
+  EVENT_NAME(FAN_DELETE),
+  EVENT_NAME(FAN_MOVE_SELF),
+  EVENT_NAME(FAN_DELETE_SELF),
+  EVENT_NAME(FAN_Q_OVERFLOW),
+};
+
+/* Size in bytes of the rings between the reader and the worker threads,
+ * split among workers (must be a power of two) */
+#define EVENT_RING_SIZE (4 * 1024 * 1024)
+
+/* Minimum size of the ring of a single worker */
+#define EVENT_RING_MIN_SIZE (256 * 1024)
+
+/* Maximum number of worker threads */
+#define MAX_WORKERS 256
+
+/* FDs kept out of the budget for event FDs in flight, for the caches and
+ * everything else the worker opens */
+#define PIPELINE_RESERVED_FDS 512
+
+/* Types of records in the event ring */
+enum {
+  RING_RECORD_EVENT = 0, /* fanotify event, metadata plus info records */
+  RING_RECORD_PROC,      /* Proc connector event */
+  RING_RECORD_PROC_LOST, /* Proc connector messages were lost */
+  RING_RECORD_BATCH,     /* Start of a read() batch, with its read time */
+  RING_RECORD_DRAINED,   /* The fanotify queue was seen empty */
+  RING_RECORD_TICK,      /* The coalescing timer expired */
+  RING_RECORD_IDLE,      /* The fanotify queue was seen empty by the reap timer */
+  RING_RECORD_PADDING,   /* Unused space up to the end of the ring */
+  RING_RECORD_STOP       /* The reader is gone */
+};
+
+/* Header of every record in the event ring */
+typedef struct {
+  /* Length of the record including this header, multiple of 8 */
+  uint32_t len;
+  uint32_t type;
+} ring_record_t;
+
+/* Lock-free single producer single consumer ring of event records. The
+ * worker sleeps on its eventfd only after flagging it, so the reader
+ * knows when a wakeup is needed. */
+typedef struct {
+  char *data;
+  uint64_t size;
+  /* Next byte to read by the worker, only advanced by the worker */
+  _Alignas(64) _Atomic uint64_t tail;
+  /* End of the records published by the reader, only advanced by it */
+  _Alignas(64) _Atomic uint64_t head;
+  /* Reader private end of the records not published yet */
+  uint64_t pending_head;
+  atomic_int worker_waiting;
+  int worker_fd;
+} event_ring_t;
+
+/* Worker thread, owning the cmdlines of its share of the PIDs */
+typedef struct {
+  pthread_t thread;
+  event_ring_t ring;
+  pid_cache_t *pid_cache;
+  output_t *output;
+} worker_t;
+
+/* Reader and worker threads of the event pipeline */
+typedef struct {
+  pthread_t reader;
+  worker_t workers[MAX_WORKERS];
+  int n_workers;
+  int fanotify_fd;
+  int proc_fd;
+  /* eventfd to stop the reader */
+  int stop_fd;
+  /* Set by the reader before sleeping on its eventfd, when a ring is
+   * full or too many event FDs are in flight */
+  atomic_int reader_waiting;
+  int reader_fd;
+  /* Maximum number of event FDs read but not closed yet */
+  long fd_budget;
+  atomic_long inflight_fds;
+} pipeline_t;
+
+static pipeline_t pipeline;
+
+/* Whether to read events in a dedicated thread */
+static int use_pipeline;
+
+/* Number of worker threads in pipeline mode */
+static int n_workers = 1;
+
+/* Number of submission queue entries of the io_uring */
+#define URING_ENTRIES 512
+
+/* Maximum number of processes whose cmdline is fetched ahead per batch,
+ * each of them owns a fixed file slot */
+#define URING_MAX_PREFETCH 64
+
+/* Kinds of io_uring operations, in the upper half of the user_data */
+enum {
+  URING_FANOTIFY = 1, /* read() of the fanotify FD */
+  URING_SIGNAL,       /* read() of the signalfd */
+  URING_PROC,         /* poll() of the proc connector socket */
+  URING_TIMER,        /* read() of the coalescing timerfd */
+  URING_REAP,         /* read() of the reap timerfd */
+  URING_STAT_OPEN,    /* open() of /proc/<pid>/stat */
+  URING_STAT_READ,    /* read() of /proc/<pid>/stat */
+  URING_CMDLINE_READ, /* read() of /proc/<pid>/cmdline */
+  URING_PREFETCH      /* Any other step of a prefetch */
+};
+
+/* Cmdline of a single process fetched ahead of a batch */
+typedef struct {
+  int pid;
+  /* Whether the cache holds an entry to validate */
+  int cached;
+  /* /proc/<pid>/stat FD, -1 if it couldn't be opened */
+  int stat_fd;
+  /* Results of the reads, negative errno on failure */
+  int stat_len;
+  int cmdline_len;
+  char stat_path[32];
+  char cmdline_path[32];
+  char stat[PID_STAT_BUFFER_SIZE];
+  char cmdline[PATH_MAX];
+} uring_prefetch_t;
+
+/* io_uring driving the main loop, and the cmdline prefetch */
+typedef struct {
+  int fd;
+  /* Submission queue */
+  void *sq_ring;
+  size_t sq_ring_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  /* Tail of the SQEs filled in, not yet made visible to the kernel */
+  unsigned sqe_tail;
+  /* Completion queue */
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* Completions of the main loop operations, seen while waiting for
+   * anything */
+  int fanotify_done;
+  int fanotify_result;
+  int signal_done;
+  int signal_result;
+  int proc_done;
+  int timer_done;
+  int reap_done;
+  struct signalfd_siginfo siginfo;
+  uint64_t timer_ticks;
+  uint64_t reap_ticks;
+  /* Prefetch of the current batch */
+  uring_prefetch_t prefetch[URING_MAX_PREFETCH];
+  int prefetch_pending;
+} uring_t;
+
+static uring_t uring;
+
+/* Whether to run the main loop on io_uring */
+static int use_uring;
+
+/* Whether to write a binary log instead of text */
+static int use_binary;
+
+/* Whether to write one JSON object per line instead of text */
+static int use_json;
+
+/* Whether text records get a line with the read time and lag */
+static int use_timing;
+
+/* Copy of raw argv contents, NUL separated, with a NUL appended */
+static char *cmdline_dup(const char *argv, size_t len) {
+    char *cmdline;
+
+    if ((cmdline = malloc(len + 1)) == NULL)
+        return NULL;
+    memcpy(cmdline, argv, len);
+    cmdline[len] = '\0';
+
+    return cmdline;
+}
+
+/* Read the raw contents of /proc/<pid>/cmdline, arguments stay NUL
+ * separated. Returns the length read, -1 on failure. */
+static ssize_t get_program_cmdline_from_pid(int pid, char *buffer, size_t buffer_size) {
     int fd;
     ssize_t len;
-    char *aux;
 
     /* Try to get program name by PID */
     sprintf(buffer, "/proc/%d/cmdline", pid);
     if ((fd = open(buffer, O_RDONLY)) < 0)
-        return NULL;
+        return -1;
 
     /* Read file contents into buffer */
     if ((len = read(fd, buffer, buffer_size - 1)) <= 0) {
         close(fd);
-        return NULL;
+        return -1;
     }
     close(fd);
 
-    for (i = 0; i < len; i++) {
-        if (buffer[i] == '\0') {
-            buffer[i] = ' ';
-        }
+    buffer[len] = '\0';
+    return len;
+}
+
+/* Parse start time and argv location from /proc/<pid>/stat contents */
+static int parse_pid_stat(char *buffer,
+                          unsigned long long *start_time,
+                          unsigned long *arg_start,
+                          unsigned long *arg_end) {
+    char *aux;
+    char *saveptr;
+    int field;
+
+    /* comm (field 2) may contain spaces and parentheses, skip past its end */
+    if ((aux = strrchr(buffer, ')')) == NULL)
+        return -1;
+
+    *start_time = 0;
+    *arg_start = 0;
+    *arg_end = 0;
+    /* First token after comm is field 3 (state) */
+    for (field = 3, aux = strtok_r(aux + 1, " ", &saveptr);
+         aux != NULL && field <= 49;
+         field++, aux = strtok_r(NULL, " ", &saveptr)) {
+        if (field == 22)
+            *start_time = strtoull(aux, NULL, 10);
+        else if (field == 48)
+            *arg_start = strtoul(aux, NULL, 10);
+        else if (field == 49)
+            *arg_end = strtoul(aux, NULL, 10);
     }
 
+    return field > 22 ? 0 : -1;
+}
+
+/* Read start time and argv location from an open /proc/<pid>/stat.
+ * Fails with ESRCH once the process behind the FD is gone. */
+static int read_pid_stat(int stat_fd,
+                         unsigned long long *start_time,
+                         unsigned long *arg_start,
+                         unsigned long *arg_end) {
+    char buffer[PID_STAT_BUFFER_SIZE];
+    ssize_t len;
+
+    if ((len = pread(stat_fd, buffer, sizeof(buffer) - 1, 0)) <= 0)
+        return -1;
     buffer[len] = '\0';
 
-    return buffer;
+    return parse_pid_stat(buffer, start_time, arg_start, arg_end);
 }
 
-static char *get_file_path_from_fd(int fd, char *buffer, size_t buffer_size) {
-    ssize_t len;
+static void pid_cache_clear(pid_cache_t *cache) {
+    int i;
 
-    if (fd <= 0)
-        return NULL;
+    for (i = 0; i < PID_CACHE_SIZE; ++i) {
+        if (cache->slots[i].pid == 0)
+            continue;
+        if (cache->slots[i].stat_fd >= 0)
+            close(cache->slots[i].stat_fd);
+        free(cache->slots[i].cmdline);
+        cache->slots[i].pid = 0;
+    }
+    for (i = 0; i < cache->n_superseded; ++i)
+        free(cache->superseded[i].cmdline);
+    cache->n_entries = 0;
+    cache->n_exited = 0;
+    cache->n_superseded = 0;
+}
 
-    sprintf(buffer, "/proc/self/fd/%d", fd);
-    if ((len = readlink(buffer, buffer, buffer_size - 1)) < 0)
-        return NULL;
+/* Set up an empty cache holding up to its share of the processes */
+static void pid_cache_init(pid_cache_t *cache, int live, int n_shards) {
+    cache->live = live;
+    cache->max_entries = (live ? PID_CACHE_MAX_LIVE_ENTRIES : PID_CACHE_MAX_ENTRIES) / n_shards;
+    if (cache->max_entries < 16)
+        cache->max_entries = 16;
+}
 
-    buffer[len] = '\0';
-    return buffer;
+static unsigned int pid_cache_hash(int pid) {
+    return ((unsigned int) pid * 2654435761u) & (PID_CACHE_SIZE - 1);
 }
 
-static void event_process(struct fanotify_event_metadata *event) {
-    char path[PATH_MAX];
-    time_t current_time;
-    char *c_time_string;
-
-    current_time = time(NULL);
-    c_time_string = ctime(&current_time);
-
-    printf("%s [%d] Event on '%s':\n",
-           strtok(c_time_string, "\n"),
-           event->pid,
-           get_file_path_from_fd(event->fd, path, PATH_MAX) ? path : "unknown");
-
-    printf("%s [%d] Event: ", strtok(c_time_string, "\n"), event->pid);
-    if (event->mask & FAN_OPEN)
-        printf("FAN_OPEN ");
-    if (event->mask & FAN_ACCESS)
-        printf("FAN_ACCESS ");
-    if (event->mask & FAN_MODIFY)
-        printf("FAN_MODIFY ");
-    if (event->mask & FAN_CLOSE_WRITE)
-        printf("FAN_CLOSE_WRITE ");
-    if (event->mask & FAN_CLOSE_NOWRITE)
-        printf("FAN_CLOSE_NOWRITE ");
-    printf("\n");
-
-    printf("%s [%d] Cmdline: %s\n\n",
-           strtok(c_time_string, "\n"),
-           event->pid,
-           (get_program_cmdline_from_pid(event->pid, path, PATH_MAX) ? path : "unknown"));
+/* Slot holding the given PID, or the free slot where it would go */
+static pid_cache_entry_t *pid_cache_slot(pid_cache_t *cache, int pid) {
+    unsigned int i;
 
-    fflush(stdout);
+    i = pid_cache_hash(pid);
+    while (cache->slots[i].pid != 0 && cache->slots[i].pid != pid)
+        i = (i + 1) & (PID_CACHE_SIZE - 1);
 
-    close(event->fd);
+    return &cache->slots[i];
 }
 
-static void shutdown_fanotify(int fanotify_fd) {
-    int i;
+static void pid_cache_remove(pid_cache_t *cache, pid_cache_entry_t *entry) {
+    unsigned int i;
+    unsigned int j;
+    unsigned int home;
 
-    for (i = 0; i < n_monitors; ++i) {
-        /* Remove the mark, using same event mask as when creating it */
-        fanotify_mark(fanotify_fd,
-                      FAN_MARK_REMOVE,
-                      event_mask,
-                      AT_FDCWD,
-                      monitors[i].path);
-        free(monitors[i].path);
+    if (entry->stat_fd >= 0)
+        close(entry->stat_fd);
+    free(entry->cmdline);
+    if (entry->exited)
+        cache->n_exited--;
+    entry->pid = 0;
+    cache->n_entries--;
+
+    /* Shift back following entries of the probe chain into the hole */
+    i = j = (unsigned int) (entry - cache->slots);
+    for (;;) {
+        j = (j + 1) & (PID_CACHE_SIZE - 1);
+        if (cache->slots[j].pid == 0)
+            break;
+        home = pid_cache_hash(cache->slots[j].pid);
+        if (((j - home) & (PID_CACHE_SIZE - 1)) >= ((j - i) & (PID_CACHE_SIZE - 1))) {
+            cache->slots[i] = cache->slots[j];
+            cache->slots[j].pid = 0;
+            i = j;
+        }
     }
-    free(monitors);
-    close(fanotify_fd);
 }
 
-static int initialize_fanotify(int argc, const char **argv) {
-    int i;
-    int fanotify_fd;
+/* Make room for another entry by dropping the first one the hand finds
+ * unused since it last went past, approximating the least recently used.
+ * Running processes go first: unlike exited ones, they can still be read
+ * from /proc again. */
+static void pid_cache_evict(pid_cache_t *cache) {
+    pid_cache_entry_t *entry;
+    int skip_exited = cache->n_exited < cache->n_entries;
+
+    for (;;) {
+        entry = &cache->slots[cache->hand];
+        if (entry->pid != 0 && !(skip_exited && entry->exited)) {
+            /* Removal may shift another entry into this slot, it's looked
+             * at next */
+            if (!entry->referenced) {
+                pid_cache_remove(cache, entry);
+                return;
+            }
+            entry->referenced = 0;
+        }
+        cache->hand = (cache->hand + 1) & (PID_CACHE_SIZE - 1);
+    }
+}
+
+/* Take a free slot for the given PID, which must not be in the cache */
+static pid_cache_entry_t *pid_cache_add(pid_cache_t *cache, int pid) {
+    pid_cache_entry_t *entry;
+
+    if (cache->n_entries >= cache->max_entries)
+        pid_cache_evict(cache);
+
+    entry = pid_cache_slot(cache, pid);
+    entry->pid = pid;
+    entry->stat_fd = -1;
+    entry->exited = 0;
+    entry->cmdline = NULL;
+    entry->cmdline_len = 0;
+    entry->verdict = 0;
+    entry->referenced = 1;
+    entry->generation = cache->generation;
+    cache->n_entries++;
+
+    return entry;
+}
+
+static void pid_cache_drop_superseded(pid_cache_t *cache, int i) {
+    free(cache->superseded[i].cmdline);
+    memmove(&cache->superseded[i],
+            &cache->superseded[i + 1],
+            (cache->n_superseded - i - 1) * sizeof(cache->superseded[0]));
+    cache->n_superseded--;
+}
+
+/* Move an exited process aside for the new process reusing its PID */
+static void pid_cache_supersede(pid_cache_t *cache, pid_cache_entry_t *entry) {
+    if (cache->n_superseded == PID_CACHE_MAX_SUPERSEDED)
+        pid_cache_drop_superseded(cache, 0);
+
+    cache->superseded[cache->n_superseded++] = *entry;
+    entry->cmdline = NULL;
+    pid_cache_remove(cache, entry);
+}
+
+/* Exited process that held a PID before it got reused, while its events
+ * may still be queued. They were queued before those of the new process,
+ * so it goes first. */
+static pid_cache_entry_t *pid_cache_superseded(pid_cache_t *cache, int pid) {
+    int i;
+
+    for (i = 0; i < cache->n_superseded; ++i) {
+        if (cache->superseded[i].pid == pid)
+            return &cache->superseded[i];
+    }
+
+    return NULL;
+}
+
+/* Store the cmdline of a process, taking ownership of the string. An
+ * exited process with the same PID is kept aside for its queued events. */
+static void pid_cache_set(pid_cache_t *cache, int pid, char *cmdline, size_t cmdline_len) {
+    pid_cache_entry_t *entry;
+
+    entry = pid_cache_slot(cache, pid);
+    if (entry->pid == pid && entry->exited)
+        pid_cache_supersede(cache, entry);
+    else if (entry->pid == pid)
+        pid_cache_remove(cache, entry);
+
+    entry = pid_cache_add(cache, pid);
+    entry->cmdline = cmdline;
+    entry->cmdline_len = cmdline ? cmdline_len : 0;
+}
+
+/* Drop processes that exited before the current read batch started. Only
+ * call it once the batch drained the fanotify queue, so that no events
+ * of those processes are left behind. */
+static void pid_cache_reap(pid_cache_t *cache) {
+    pid_cache_entry_t *entry;
+    int i;
+
+    for (i = 0; i < PID_CACHE_SIZE && cache->n_exited > 0;) {
+        entry = &cache->slots[i];
+        if (entry->pid != 0 &&
+            entry->exited &&
+            entry->generation < cache->generation) {
+            /* Removal may shift another entry into this slot */
+            pid_cache_remove(cache, entry);
+            continue;
+        }
+        i++;
+    }
+
+    for (i = 0; i < cache->n_superseded;) {
+        if (cache->superseded[i].generation < cache->generation) {
+            pid_cache_drop_superseded(cache, i);
+            continue;
+        }
+        i++;
+    }
+}
+
+/* While the fanotify queue is idle, drop processes that exited before the
+ * previous check: none of their events can be in flight anymore */
+static void pid_cache_reap_idle(pid_cache_t *cache) {
+    pid_cache_reap(cache);
+    cache->generation++;
+}
+
+/* Get the cmdline of the given PID, served from memory while the process
+ * keeps its identity. Entries fed by the proc connector are always up to
+ * date. Otherwise an entry is validated at most once per read batch with
+ * a single pread() of its /proc/<pid>/stat: the read fails if the process
+ * exited (even if the PID got reused), and argv moves on exec. */
+static const char *pid_cache_get_cmdline(pid_cache_t *cache, int pid, size_t *cmdline_len) {
+    char buffer[PATH_MAX];
+    pid_cache_entry_t *entry;
+    unsigned long long start_time;
+    unsigned long arg_start;
+    unsigned long arg_end;
+    ssize_t len;
+
+    if (cache->n_superseded > 0 &&
+        (entry = pid_cache_superseded(cache, pid)) != NULL) {
+        *cmdline_len = entry->cmdline_len;
+        return entry->cmdline;
+    }
+
+    entry = pid_cache_slot(cache, pid);
+    if (entry->pid == pid) {
+        entry->referenced = 1;
+        *cmdline_len = entry->cmdline_len;
+        if (cache->live || entry->generation == cache->generation)
+            return entry->cmdline;
+
+        /* Without permission to see argv location, refresh once per batch */
+        if (read_pid_stat(entry->stat_fd, &start_time, &arg_start, &arg_end) == 0 &&
+            start_time == entry->start_time &&
+            arg_start == entry->arg_start &&
+            arg_end == entry->arg_end &&
+            arg_start != 0) {
+            entry->generation = cache->generation;
+            return entry->cmdline;
+        }
+
+        /* Process exited or exec'ed */
+        pid_cache_remove(cache, entry);
+    }
+
+    /* Process started before the proc connector was listening */
+    if (cache->live) {
+        entry = pid_cache_add(cache, pid);
+        if ((len = get_program_cmdline_from_pid(pid, buffer, PATH_MAX)) > 0 &&
+            (entry->cmdline = cmdline_dup(buffer, len)) != NULL)
+            entry->cmdline_len = len;
+        *cmdline_len = entry->cmdline_len;
+        return entry->cmdline;
+    }
+
+    sprintf(buffer, "/proc/%d/stat", pid);
+    entry = pid_cache_add(cache, pid);
+    if ((entry->stat_fd = open(buffer, O_RDONLY | O_CLOEXEC)) < 0 ||
+        read_pid_stat(entry->stat_fd,
+                      &entry->start_time,
+                      &entry->arg_start,
+                      &entry->arg_end) < 0 ||
+        (len = get_program_cmdline_from_pid(pid, buffer, PATH_MAX)) < 0 ||
+        (entry->cmdline = cmdline_dup(buffer, len)) == NULL) {
+        pid_cache_remove(cache, entry);
+        return NULL;
+    }
+
+    entry->cmdline_len = len;
+    *cmdline_len = len;
+    return entry->cmdline;
+}
+
+static char *get_file_path_from_fd(int fd, char *buffer, size_t buffer_size) {
+    char proc_path[32];
+    ssize_t len;
+
+    if (fd <= 0)
+        return NULL;
+
+    sprintf(proc_path, "/proc/self/fd/%d", fd);
+    if ((len = readlink(proc_path, buffer, buffer_size - 1)) < 0)
+        return NULL;
+
+    buffer[len] = '\0';
+    return buffer;
+}
+
+/* Monitored directory FD on the given filesystem, to open handles from */
+static int get_mount_fd_from_fsid(const __kernel_fsid_t *fsid) {
+    int i;
+
+    for (i = 0; i < n_monitors; ++i) {
+        if (memcmp(&monitors[i].fsid, fsid, sizeof(*fsid)) == 0)
+            return monitors[i].dir_fd;
+    }
+    return -1;
+}
+
+static void fid_cache_clear(fid_cache_t *cache) {
+    int i;
+
+    for (i = 0; i < FID_CACHE_SIZE; ++i) {
+        free(cache->slots[i].path);
+        cache->slots[i].path = NULL;
+    }
+    cache->n_entries = 0;
+}
+
+/* FNV-1a over the filesystem ID and the handle */
+static unsigned int fid_cache_hash(const __kernel_fsid_t *fsid,
+                                   const struct file_handle *handle) {
+    const unsigned char *bytes;
+    unsigned int hash = 2166136261u;
+    unsigned int i;
+
+    bytes = (const unsigned char *) fsid;
+    for (i = 0; i < sizeof(*fsid); ++i)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    hash = (hash ^ (unsigned int) handle->handle_type) * 16777619u;
+    for (i = 0; i < handle->handle_bytes; ++i)
+        hash = (hash ^ handle->f_handle[i]) * 16777619u;
+
+    return hash;
+}
+
+/* Slot holding the given handle, or the free slot where it would go */
+static fid_cache_entry_t *fid_cache_slot(fid_cache_t *cache,
+                                         unsigned int hash,
+                                         const __kernel_fsid_t *fsid,
+                                         const struct file_handle *handle) {
+    fid_cache_entry_t *entry;
+    unsigned int i;
+
+    for (i = hash & (FID_CACHE_SIZE - 1);; i = (i + 1) & (FID_CACHE_SIZE - 1)) {
+        entry = &cache->slots[i];
+        if (entry->path == NULL ||
+            (entry->hash == hash &&
+             entry->handle_type == handle->handle_type &&
+             entry->handle_bytes == handle->handle_bytes &&
+             memcmp(&entry->fsid, fsid, sizeof(*fsid)) == 0 &&
+             memcmp(entry->handle, handle->f_handle, handle->handle_bytes) == 0))
+            return entry;
+    }
+}
+
+static void fid_cache_remove(fid_cache_t *cache, fid_cache_entry_t *entry) {
+    unsigned int i;
+    unsigned int j;
+    unsigned int home;
+
+    free(entry->path);
+    entry->path = NULL;
+    cache->n_entries--;
+
+    /* Shift back following entries of the probe chain into the hole */
+    i = j = (unsigned int) (entry - cache->slots);
+    for (;;) {
+        j = (j + 1) & (FID_CACHE_SIZE - 1);
+        if (cache->slots[j].path == NULL)
+            break;
+        home = cache->slots[j].hash & (FID_CACHE_SIZE - 1);
+        if (((j - home) & (FID_CACHE_SIZE - 1)) >= ((j - i) & (FID_CACHE_SIZE - 1))) {
+            cache->slots[i] = cache->slots[j];
+            cache->slots[j].path = NULL;
+            i = j;
+        }
+    }
+}
+
+/* Make room for another directory by dropping the first one the hand
+ * finds unused since it last went past, as for the PID cache */
+static void fid_cache_evict(fid_cache_t *cache) {
+    fid_cache_entry_t *entry;
+
+    for (;;) {
+        entry = &cache->slots[cache->hand];
+        if (entry->path != NULL) {
+            /* Removal may shift another entry into this slot, it's looked
+             * at next */
+            if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed)) {
+                fid_cache_remove(cache, entry);
+                return;
+            }
+            atomic_store_explicit(&entry->referenced, 0, memory_order_relaxed);
+        }
+        cache->hand = (cache->hand + 1) & (FID_CACHE_SIZE - 1);
+    }
+}
+
+/* Drop the given directory and everything below it, after it was renamed
+ * or deleted */
+static void fid_cache_invalidate(fid_cache_t *cache, const char *path) {
+    fid_cache_entry_t *entry;
+    size_t len;
+    int i;
+
+    len = strlen(path);
+    pthread_rwlock_wrlock(&cache->lock);
+    for (i = 0; i < FID_CACHE_SIZE && cache->n_entries > 0;) {
+        entry = &cache->slots[i];
+        if (entry->path != NULL &&
+            strncmp(entry->path, path, len) == 0 &&
+            (entry->path[len] == '\0' || entry->path[len] == '/')) {
+            /* Removal may shift another entry into this slot */
+            fid_cache_remove(cache, entry);
+            continue;
+        }
+        i++;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+/* Drop all cached directories, e.g. after a monitored directory moved */
+static void fid_cache_flush(fid_cache_t *cache) {
+    pthread_rwlock_wrlock(&cache->lock);
+    fid_cache_clear(cache);
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+/* Get the path of the directory behind a file handle into the buffer,
+ * opening the handle only the first time the directory is seen */
+static char *fid_cache_get_path(fid_cache_t *cache,
+                                const __kernel_fsid_t *fsid,
+                                struct file_handle *handle,
+                                char *buffer,
+                                size_t buffer_size) {
+    fid_cache_entry_t *entry;
+    unsigned int hash;
+    int mount_fd;
+    int fd;
+    int found;
+
+    if (handle->handle_bytes > MAX_HANDLE_SZ)
+        return NULL;
+
+    hash = fid_cache_hash(fsid, handle);
+
+    pthread_rwlock_rdlock(&cache->lock);
+    entry = fid_cache_slot(cache, hash, fsid, handle);
+    if (entry->path != NULL) {
+        if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+            atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+        found = snprintf(buffer, buffer_size, "%s", entry->path) < (int) buffer_size;
+        pthread_rwlock_unlock(&cache->lock);
+        return found ? buffer : NULL;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    if ((mount_fd = get_mount_fd_from_fsid(fsid)) < 0)
+        return NULL;
+    if ((fd = open_by_handle_at(mount_fd, handle, O_PATH | O_CLOEXEC)) < 0)
+        return NULL;
+    if (get_file_path_from_fd(fd, buffer, buffer_size) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    pthread_rwlock_wrlock(&cache->lock);
+    /* Another worker may have added it meanwhile */
+    entry = fid_cache_slot(cache, hash, fsid, handle);
+    if (entry->path == NULL) {
+        if (cache->n_entries >= FID_CACHE_MAX_ENTRIES) {
+            fid_cache_evict(cache);
+            entry = fid_cache_slot(cache, hash, fsid, handle);
+        }
+        entry->path = strdup(buffer);
+        atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+        entry->hash = hash;
+        entry->fsid = *fsid;
+        entry->handle_type = handle->handle_type;
+        entry->handle_bytes = handle->handle_bytes;
+        memcpy(entry->handle, handle->f_handle, handle->handle_bytes);
+        cache->n_entries++;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    return buffer;
+}
+
+/* Resolve the path of an event reported with FAN_REPORT_DFID_NAME: the
+ * info record carries the handle of the parent directory plus the entry
+ * name, so only the directory needs to be looked up. */
+static char *get_file_path_from_fid(struct fanotify_event_metadata *event,
+                                    char *buffer,
+                                    size_t buffer_size) {
+    struct fanotify_event_info_header *info;
+    struct fanotify_event_info_fid *fid = NULL;
+    struct file_handle *handle;
+    const char *name;
+    char *end;
+    size_t len;
+
+    /* Info records follow the metadata, up to the end of the event */
+    end = (char *) event + event->event_len;
+    for (info = (struct fanotify_event_info_header *) ((char *) event + event->metadata_len);
+         (char *) info + sizeof(*info) <= end && info->len > 0;
+         info = (struct fanotify_event_info_header *) ((char *) info + info->len)) {
+        if (info->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+            fid = (struct fanotify_event_info_fid *) info;
+            break;
+        }
+    }
+    if (fid == NULL)
+        return NULL;
+
+    handle = (struct file_handle *) fid->handle;
+    name = (const char *) handle->f_handle + handle->handle_bytes;
+
+    if (fid_cache_get_path(&fid_cache, &fid->fsid, handle, buffer, buffer_size) == NULL)
+        return NULL;
+
+    /* Events on the directory itself are reported with name "." */
+    if (strcmp(name, ".") != 0) {
+        len = strlen(buffer);
+        if (snprintf(buffer + len, buffer_size - len, "/%s", name) >= (int) (buffer_size - len))
+            return NULL;
+    }
+
+    return buffer;
+}
+
+/* Forget all interned strings, they get defined again when next used */
+static void string_table_reset(string_table_t *strings) {
+    memset(strings->slots, 0, sizeof(strings->slots));
+    strings->n_entries = 0;
+    strings->arena_len = 0;
+}
+
+/* Copy a chunk into the shared memory ring, overwriting the oldest data */
+static void mmap_ring_write(const char *data, size_t len) {
+    mmap_ring_header_t *header = mmap_ring.header;
+    uint64_t head;
+    size_t offset;
+    size_t first;
+
+    head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    atomic_store_explicit(&header->reserve, head + len, memory_order_relaxed);
+    /* Consumers must see reserve move before the data changes */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    offset = head & (mmap_ring.size - 1);
+    first = len < mmap_ring.size - offset ? len : mmap_ring.size - offset;
+    memcpy(mmap_ring.data + offset, data, first);
+    memcpy(mmap_ring.data, data + first, len - first);
+
+    atomic_store_explicit(&header->head, head + len, memory_order_release);
+}
+
+/* Monotonic time in nanoseconds, 0 when metrics are off */
+static uint64_t metrics_now(void) {
+    struct timespec now;
+
+    if (!use_metrics)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void histogram_add(int metric, uint64_t value) {
+    histogram_t *histogram = &histograms[metric];
+    int bucket;
+
+    if (!use_metrics)
+        return;
+
+    bucket = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+}
+
+/* Write all of a buffer, returns -1 on failure */
+static int write_all(int fd, const char *data, size_t len) {
+    size_t done = 0;
+    ssize_t written;
+
+    while (done < len) {
+        if ((written = write(fd, data + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += written;
+    }
+
+    return 0;
+}
+
+static int file_sink_open(void) {
+    binary_log_header_t header = {.magic = BINARY_LOG_MAGIC, .version = BINARY_LOG_VERSION};
+    struct stat st;
+
+    if ((file_sink.fd = open(file_sink.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0 ||
+        fstat(file_sink.fd, &st) < 0) {
+        fprintf(stderr,
+                "Couldn't open '%s': '%s'\n",
+                file_sink.path,
+                strerror(errno));
+        return -1;
+    }
+    file_sink.size = st.st_size;
+    file_sink.opened = time(NULL);
+
+    /* Every segment of a binary log can be decoded on its own */
+    if (use_binary && file_sink.size == 0) {
+        if (write_all(file_sink.fd, (const char *) &header, sizeof(header)) < 0)
+            return -1;
+        file_sink.size = sizeof(header);
+    }
+
+    return 0;
+}
+
+/* Rename the current segment aside and start a new one */
+static void file_sink_rotate(void) {
+    char stamp[32];
+    segment_t *segment;
+    size_t len;
+    time_t now;
+    struct tm tm;
+
+    now = time(NULL);
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    len = strlen(file_sink.path) + sizeof(stamp) + 16;
+    if ((segment = malloc(sizeof(*segment) + len)) == NULL)
+        return;
+    do {
+        snprintf(segment->path, len, "%s.%s.%u", file_sink.path, stamp, file_sink.n_rotations++);
+    } while (access(segment->path, F_OK) == 0);
+
+    if (rename(file_sink.path, segment->path) < 0) {
+        fprintf(stderr,
+                "Couldn't rotate '%s': '%s'\n",
+                file_sink.path,
+                strerror(errno));
+        free(segment);
+        /* Keep writing to the current segment, retry later */
+        file_sink.opened = now;
+        return;
+    }
+    close(file_sink.fd);
+    file_sink_open();
+
+    if (!file_sink.compress) {
+        free(segment);
+        return;
+    }
+
+    pthread_mutex_lock(&file_sink.lock);
+    segment->next = NULL;
+    *file_sink.pending_tail = segment;
+    file_sink.pending_tail = &segment->next;
+    pthread_cond_signal(&file_sink.cond);
+    pthread_mutex_unlock(&file_sink.lock);
+}
+
+/* Write a chunk to stdout, or to the output file, rotating it first if
+ * due. Callers take care that only one thread writes at a time. */
+static int sink_write(const char *data, size_t len) {
+    if (file_sink.path == NULL)
+        return write_all(STDOUT_FILENO, data, len);
+
+    if ((file_sink.rotate_size > 0 &&
+         file_sink.size > 0 &&
+         file_sink.size + len > file_sink.rotate_size) ||
+        (file_sink.rotate_interval > 0 &&
+         time(NULL) >= file_sink.opened + file_sink.rotate_interval))
+        file_sink_rotate();
+
+    if (file_sink.fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (write_all(file_sink.fd, data, len) < 0)
+        return -1;
+    file_sink.size += len;
+
+    return 0;
+}
+
+static void writer_spill(const char *data, size_t len) {
+    size_t done = 0;
+    ssize_t written;
+
+    while (done < len) {
+        if ((written = pwrite(writer.spill_fd, data + done, len - done, writer.spill_write + done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            /* Partial chunks are never kept */
+            writer.dropped_chunks++;
+            writer.dropped_bytes += len;
+            return;
+        }
+        done += written;
+    }
+    writer.spill_write += len;
+    writer.spilled_bytes += len;
+}
+
+/* Queue a chunk for the writer thread, applying the policy if it doesn't
+ * fit */
+static void writer_push(const char *data, size_t len) {
+    uint64_t size = (8 + len + 7) & ~(uint64_t) 7;
+    uint64_t offset;
+    uint64_t first;
+    uint64_t chunk_len;
+
+    pthread_mutex_lock(&writer.lock);
+    if (writer.policy == WRITER_SPILL && writer.spill_write > writer.spill_read) {
+        writer_spill(data, len);
+        pthread_cond_signal(&writer.data_ready);
+        pthread_mutex_unlock(&writer.lock);
+        return;
+    }
+
+    while (WRITER_BUFFER_SIZE - (writer.head - writer.tail) < size) {
+        switch (writer.policy) {
+        case WRITER_BLOCK:
+            pthread_cond_wait(&writer.room_ready, &writer.lock);
+            break;
+        case WRITER_DROP_OLDEST:
+            memcpy(&chunk_len, writer.data + (writer.tail & (WRITER_BUFFER_SIZE - 1)), 8);
+            writer.tail += (8 + chunk_len + 7) & ~(uint64_t) 7;
+            writer.dropped_chunks++;
+            writer.dropped_bytes += chunk_len;
+            break;
+        case WRITER_DROP_NEWEST:
+            writer.dropped_chunks++;
+            writer.dropped_bytes += len;
+            pthread_mutex_unlock(&writer.lock);
+            return;
+        default:
+            writer_spill(data, len);
+            pthread_cond_signal(&writer.data_ready);
+            pthread_mutex_unlock(&writer.lock);
+            return;
+        }
+    }
+
+    /* Lengths are 8 byte aligned, they never wrap */
+    chunk_len = len;
+    offset = writer.head & (WRITER_BUFFER_SIZE - 1);
+    memcpy(writer.data + offset, &chunk_len, 8);
+    offset += 8;
+    first = len < WRITER_BUFFER_SIZE - offset ? len : WRITER_BUFFER_SIZE - offset;
+    memcpy(writer.data + offset, data, first);
+    memcpy(writer.data, data + first, len - first);
+    writer.head += size;
+
+    pthread_cond_signal(&writer.data_ready);
+    pthread_mutex_unlock(&writer.lock);
+}
+
+/* Write out all formatted records at once */
+static void output_flush(output_t *out) {
+    uint64_t start;
+
+    if (out->len == 0)
+        return;
+
+    start = metrics_now();
+    if (use_writer) {
+        writer_push(out->data, out->len);
+    } else {
+        pthread_mutex_lock(&output_lock);
+        if (mmap_ring.header != NULL)
+            mmap_ring_write(out->data, out->len);
+        else if (sink_write(out->data, out->len) < 0)
+            fprintf(stderr,
+                    "Couldn't write output: '%s'\n",
+                    strerror(errno));
+        pthread_mutex_unlock(&output_lock);
+    }
+
+    if (out->strings != NULL && strings_per_chunk)
+        string_table_reset(out->strings);
+
+    out->len = 0;
+    histogram_add(METRIC_OUTPUT_WRITE, metrics_now() - start);
+}
+
+static void output_append(output_t *out, const char *string, size_t len) {
+    memcpy(out->data + out->len, string, len);
+    out->len += len;
+}
+
+static void output_append_uint(output_t *out, unsigned long long value) {
+    char digits[20];
+    int i = sizeof(digits);
+
+    do {
+        digits[--i] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    output_append(out, digits + i, sizeof(digits) - i);
+}
+
+static void output_append_uint_padded(output_t *out, unsigned long long value, int width) {
+    char digits[20];
+    int i = sizeof(digits);
+
+    do {
+        digits[--i] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (--width > 0 || value != 0);
+
+    output_append(out, digits + i, sizeof(digits) - i);
+}
+
+static void output_append_timespec(output_t *out, const struct timespec *ts) {
+    output_append_uint(out, (unsigned long long) ts->tv_sec);
+    output_append(out, ".", 1);
+    output_append_uint_padded(out, (unsigned long long) ts->tv_nsec, 9);
+}
+
+/* Take the read time of a batch, a single pair of clock reads */
+static void batch_time_get(batch_time_t *batch) {
+    clock_gettime(CLOCK_REALTIME, &batch->realtime);
+    clock_gettime(CLOCK_MONOTONIC, &batch->monotonic);
+}
+
+/* Render the timestamp of the batch again if the second changed */
+static void output_update_time(output_t *out) {
+    time_t current_time;
+
+    current_time = out->batch.realtime.tv_sec;
+    if (current_time == out->time && out->time_len > 0)
+        return;
+
+    out->time = current_time;
+    ctime_r(&current_time, out->time_string);
+    out->time_len = strcspn(out->time_string, "\n");
+    memcpy(out->time_string + out->time_len, " [", 2);
+    out->time_len += 2;
+}
+
+/* Timestamp and PID starting every line of a record */
+static void output_append_prefix(output_t *out, int pid) {
+    output_append(out, out->time_string, out->time_len);
+    output_append_uint(out, (unsigned int) pid);
+    output_append(out, "] ", 2);
+}
+
+/* Append argv contents with arguments separated by spaces */
+static void output_append_cmdline(output_t *out, const char *cmdline, size_t len) {
+    char *start;
+    char *end;
+
+    start = out->data + out->len;
+    output_append(out, cmdline, len);
+    end = out->data + out->len;
+    while ((start = memchr(start, '\0', end - start)) != NULL)
+        *start++ = ' ';
+}
+
+/* Names of the flags set in an event mask */
+static void output_append_mask(output_t *out, uint64_t mask) {
+    size_t i;
+
+    for (i = 0; i < sizeof(event_names) / sizeof(event_names[0]); ++i) {
+        if (mask & event_names[i].flag)
+            output_append(out, event_names[i].name, event_names[i].len);
+    }
+}
+
+/* Format a record in the text format */
+static void output_append_event(output_t *out,
+                                int pid,
+                                uint64_t mask,
+                                const char *path,
+                                const char *cmdline,
+                                size_t cmdline_len,
+                                unsigned long long lag,
+                                unsigned int count) {
+    output_update_time(out);
+
+    output_append_prefix(out, pid);
+    output_append(out, "Event on '", 10);
+    output_append(out, path, strlen(path));
+    output_append(out, "':\n", 3);
+
+    output_append_prefix(out, pid);
+    output_append(out, "Event: ", 7);
+    output_append_mask(out, mask);
+    if (count > 1) {
+        output_append(out, "(", 1);
+        output_append_uint(out, count);
+        output_append(out, " events)", 8);
+    }
+    output_append(out, "\n", 1);
+
+    output_append_prefix(out, pid);
+    output_append(out, "Cmdline: ", 9);
+    output_append_cmdline(out, cmdline, cmdline_len);
+    output_append(out, "\n", 1);
+
+    if (use_timing) {
+        output_append_prefix(out, pid);
+        output_append(out, "Time: ", 6);
+        output_append_timespec(out, &out->batch.realtime);
+        output_append(out, " monotonic ", 11);
+        output_append_timespec(out, &out->batch.monotonic);
+        output_append(out, " lag ", 5);
+        output_append_uint(out, lag);
+        output_append(out, "ns\n", 3);
+    }
+    output_append(out, "\n", 1);
+}
+
+static uint32_t string_hash(const char *string, size_t len) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) string[i]) * 16777619u;
+
+    return hash;
+}
+
+/* ID of the string in the binary log, defining it first if needed */
+static uint64_t output_intern(output_t *out, const char *string) {
+    string_table_t *strings = out->strings;
+    binary_string_t *record;
+    string_entry_t *entry;
+    uint32_t hash;
+    size_t len;
+    unsigned int i;
+
+    if (string == NULL)
+        return 0;
+
+    len = strlen(string);
+    hash = string_hash(string, len);
+    for (i = hash & (STRING_TABLE_SIZE - 1);
+         strings->slots[i].id != 0;
+         i = (i + 1) & (STRING_TABLE_SIZE - 1)) {
+        entry = &strings->slots[i];
+        if (entry->hash == hash && strcmp(strings->arena + entry->offset, string) == 0)
+            return ((uint64_t) out->stream << 32) | entry->id;
+    }
+
+    /* Start over once full, IDs get defined again */
+    if (strings->n_entries >= STRING_TABLE_MAX_ENTRIES ||
+        strings->arena_len + len + 1 > STRING_ARENA_SIZE) {
+        string_table_reset(strings);
+        for (i = hash & (STRING_TABLE_SIZE - 1); strings->slots[i].id != 0; i = (i + 1) & (STRING_TABLE_SIZE - 1));
+    }
+
+    entry = &strings->slots[i];
+    entry->hash = hash;
+    entry->id = ++strings->n_entries;
+    entry->offset = (uint32_t) strings->arena_len;
+    memcpy(strings->arena + strings->arena_len, string, len + 1);
+    strings->arena_len += len + 1;
+
+    record = (binary_string_t *) (out->data + out->len);
+    record->header.type = BINARY_RECORD_STRING;
+    record->header.len = (uint32_t) ((sizeof(*record) + len + 1 + 7) & ~(size_t) 7);
+    record->id = ((uint64_t) out->stream << 32) | entry->id;
+    memset((char *) (record + 1) + len, 0, record->header.len - sizeof(*record) - len);
+    memcpy(record + 1, string, len);
+    out->len += record->header.len;
+
+    return record->id;
+}
+
+/* Format a record in the binary log format */
+static void output_append_binary_event(output_t *out,
+                                       int pid,
+                                       uint64_t mask,
+                                       const char *path,
+                                       const char *cmdline,
+                                       size_t cmdline_len,
+                                       unsigned long long lag,
+                                       unsigned int count) {
+    binary_event_t event;
+    char buffer[PATH_MAX];
+    size_t i;
+
+    /* The log keeps the cmdline as in the text format */
+    if (cmdline != NULL) {
+        if (cmdline_len >= sizeof(buffer))
+            cmdline_len = sizeof(buffer) - 1;
+        for (i = 0; i < cmdline_len; i++)
+            buffer[i] = cmdline[i] ? cmdline[i] : ' ';
+        buffer[cmdline_len] = '\0';
+        cmdline = buffer;
+    }
+
+    event.path_id = output_intern(out, path);
+    event.cmdline_id = output_intern(out, cmdline);
+    event.header.type = BINARY_RECORD_EVENT;
+    event.header.len = sizeof(event);
+    event.realtime_ns = (uint64_t) out->batch.realtime.tv_sec * 1000000000ULL + out->batch.realtime.tv_nsec;
+    event.monotonic_ns = (uint64_t) out->batch.monotonic.tv_sec * 1000000000ULL + out->batch.monotonic.tv_nsec;
+    event.lag_ns = lag;
+    event.mask = mask;
+    event.pid = pid;
+    event.count = count;
+    output_append(out, (const char *) &event, sizeof(event));
+}
+
+/* Length of the valid UTF-8 sequence starting with a non-ASCII byte, 0 if
+ * invalid */
+static size_t utf8_sequence_length(const unsigned char *s, size_t len) {
+    unsigned char min = 0x80;
+    unsigned char max = 0xbf;
+    size_t n;
+    size_t i;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        n = 2;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        n = 3;
+        if (s[0] == 0xe0)
+            min = 0xa0;
+        else if (s[0] == 0xed)
+            max = 0x9f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        n = 4;
+        if (s[0] == 0xf0)
+            min = 0x90;
+        else if (s[0] == 0xf4)
+            max = 0x8f;
+    } else {
+        return 0;
+    }
+
+    if (len < n || s[1] < min || s[1] > max)
+        return 0;
+    for (i = 2; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;
+    }
+
+    return n;
+}
+
+/* Whether a string is valid UTF-8 */
+static int utf8_valid(const char *string, size_t len) {
+    const unsigned char *s = (const unsigned char *) string;
+    size_t i = 0;
+    size_t n;
+
+    while (i < len) {
+        if (s[i] < 0x80)
+            i++;
+        else if ((n = utf8_sequence_length(s + i, len - i)) > 0)
+            i += n;
+        else
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Append bytes as a base64 JSON string */
+static void output_append_base64(output_t *out, const char *string, size_t len) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *s = (const unsigned char *) string;
+    char quad[4];
+    uint32_t bits;
+    size_t i;
+
+    output_append(out, "\"", 1);
+    for (i = 0; i < len; i += 3) {
+        bits = (uint32_t) s[i] << 16;
+        if (i + 1 < len)
+            bits |= (uint32_t) s[i + 1] << 8;
+        if (i + 2 < len)
+            bits |= s[i + 2];
+        quad[0] = alphabet[bits >> 18];
+        quad[1] = alphabet[(bits >> 12) & 0x3f];
+        quad[2] = i + 1 < len ? alphabet[(bits >> 6) & 0x3f] : '=';
+        quad[3] = i + 2 < len ? alphabet[bits & 0x3f] : '=';
+        output_append(out, quad, 4);
+    }
+    output_append(out, "\"", 1);
+}
+
+/* Append a JSON string. Valid UTF-8 goes through as is, bytes that are
+ * not part of it are escaped as \u00XX, which reads like U+0080-U+00FF:
+ * the exact bytes of such strings are given in base64 besides. */
+static void output_append_json_string(output_t *out, const char *string, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *) string;
+    char escape[6] = {'\\', 'u', '0', '0'};
+    size_t start = 0;
+    size_t i = 0;
+    size_t n;
+
+    output_append(out, "\"", 1);
+    while (i < len) {
+        if (s[i] >= 0x20 && s[i] < 0x80 && s[i] != '"' && s[i] != '\\') {
+            i++;
+            continue;
+        }
+        if (s[i] >= 0x80 && (n = utf8_sequence_length(s + i, len - i)) > 0) {
+            i += n;
+            continue;
+        }
+
+        output_append(out, string + start, i - start);
+        switch (s[i]) {
+        case '"':
+            output_append(out, "\\\"", 2);
+            break;
+        case '\\':
+            output_append(out, "\\\\", 2);
+            break;
+        case '\n':
+            output_append(out, "\\n", 2);
+            break;
+        case '\t':
+            output_append(out, "\\t", 2);
+            break;
+        default:
+            escape[4] = hex[s[i] >> 4];
+            escape[5] = hex[s[i] & 0xf];
+            output_append(out, escape, 6);
+            break;
+        }
+        start = ++i;
+    }
+    output_append(out, string + start, i - start);
+    output_append(out, "\"", 1);
+}
+
+/* Format a record as a single line JSON object */
+static void output_append_json_event(output_t *out,
+                                     int pid,
+                                     uint64_t mask,
+                                     const char *path,
+                                     const char *cmdline,
+                                     size_t cmdline_len,
+                                     unsigned long long lag,
+                                     unsigned int count) {
+    const char *end;
+    size_t start;
+    size_t i;
+    int first = 1;
+
+    output_append(out, "{\"realtime_ns\":", 15);
+    output_append_uint(out, (unsigned long long) out->batch.realtime.tv_sec * 1000000000ULL + out->batch.realtime.tv_nsec);
+    output_append(out, ",\"monotonic_ns\":", 16);
+    output_append_uint(out, (unsigned long long) out->batch.monotonic.tv_sec * 1000000000ULL + out->batch.monotonic.tv_nsec);
+    output_append(out, ",\"lag_ns\":", 10);
+    output_append_uint(out, lag);
+    output_append(out, ",\"pid\":", 7);
+    output_append_uint(out, (unsigned int) pid);
+
+    output_append(out, ",\"events\":[", 11);
+    for (i = 0; i < sizeof(event_names) / sizeof(event_names[0]); ++i) {
+        if (!(mask & event_names[i].flag))
+            continue;
+        if (!first)
+            output_append(out, ",", 1);
+        first = 0;
+        output_append(out, "\"", 1);
+        output_append(out, event_names[i].name, event_names[i].len - 1);
+        output_append(out, "\"", 1);
+    }
+
+    output_append(out, "],\"count\":", 10);
+    output_append_uint(out, count);
+    output_append(out, ",\"path\":", 8);
+    if (path != NULL) {
+        output_append_json_string(out, path, strlen(path));
+        if (!utf8_valid(path, strlen(path))) {
+            output_append(out, ",\"path_bytes\":", 14);
+            output_append_base64(out, path, strlen(path));
+        }
+    } else {
+        output_append(out, "null", 4);
+    }
+
+    /* One string per argument */
+    output_append(out, ",\"argv\":", 8);
+    if (cmdline != NULL) {
+        output_append(out, "[", 1);
+        for (start = 0; start < cmdline_len; start = end - cmdline + 1) {
+            if ((end = memchr(cmdline + start, '\0', cmdline_len - start)) == NULL)
+                end = cmdline + cmdline_len;
+            if (start > 0)
+                output_append(out, ",", 1);
+            output_append_json_string(out, cmdline + start, end - cmdline - start);
+        }
+        output_append(out, "]", 1);
+
+        /* Exact arguments, only when some are not UTF-8 */
+        if (!utf8_valid(cmdline, cmdline_len)) {
+            output_append(out, ",\"argv_bytes\":[", 15);
+            for (start = 0; start < cmdline_len; start = end - cmdline + 1) {
+                if ((end = memchr(cmdline + start, '\0', cmdline_len - start)) == NULL)
+                    end = cmdline + cmdline_len;
+                if (start > 0)
+                    output_append(out, ",", 1);
+                output_append_base64(out, cmdline + start, end - cmdline - start);
+            }
+            output_append(out, "]", 1);
+        }
+    } else {
+        output_append(out, "null", 4);
+    }
+    output_append(out, "}\n", 2);
+}
+
+/* Add a plain prefix to the trie, trailing slashes aside */
+static int path_filter_add_prefix(const char *prefix, int flags) {
+    path_trie_node_t *nodes;
+    size_t len = strlen(prefix);
+    uint32_t node = 0;
+    uint32_t child;
+    size_t i;
+
+    while (len > 0 && prefix[len - 1] == '/')
+        len--;
+
+    for (i = 0; i < len; i++) {
+        for (child = path_filter.nodes[node].child;
+             child != 0 && path_filter.nodes[child].byte != (unsigned char) prefix[i];
+             child = path_filter.nodes[child].sibling);
+
+        if (child == 0) {
+            if ((nodes = realloc(path_filter.nodes,
+                                 (path_filter.n_nodes + 1) * sizeof(*nodes))) == NULL)
+                return -1;
+            path_filter.nodes = nodes;
+            child = path_filter.n_nodes++;
+            memset(&nodes[child], 0, sizeof(nodes[child]));
+            nodes[child].byte = prefix[i];
+            nodes[child].sibling = nodes[node].child;
+            nodes[node].child = child;
+        }
+        node = child;
+    }
+
+    path_filter.nodes[node].flags |= flags;
+    return 0;
+}
+
+static void glob_class_set(glob_state_t *state, unsigned char c) {
+    state->class[c >> 6] |= 1ULL << (c & 63);
+}
+
+static int glob_class_has(const glob_state_t *state, unsigned char c) {
+    return (state->class[c >> 6] >> (c & 63)) & 1;
+}
+
+/* Compile a glob into states: '*' matches within a path component, '**'
+ * across components, "**" followed by '/' zero or more whole
+ * components, '?' one character, "[...]" a class ('!' or '^' negates,
+ * ranges allowed), '\' escapes. Globs without '/' match the last
+ * component. */
+static int path_filter_add_glob(const char *glob, int flags) {
+    glob_state_t *states = path_filter.states;
+    glob_state_t *state;
+    const char *p = glob;
+    uint32_t n = path_filter.n_states;
+    int prefixed;
+    int negate;
+    int c;
+
+    /* Matched as if it started with "**" followed by '/' */
+    if ((prefixed = strchr(glob, '/') == NULL))
+        p = "**/";
+
+    while (*p != '\0' || prefixed) {
+        if (*p == '\0') {
+            p = glob;
+            prefixed = 0;
+            continue;
+        }
+
+        /* Up to three states per element, and one more for the end */
+        if (n + 4 >= PATH_FILTER_MAX_STATES)
+            return -1;
+        state = &states[n++];
+
+        if (p[0] == '*' && p[1] == '*' && p[2] == '/') {
+            /* Either no component at all, or anything up to a slash */
+            state->loop = 1;
+            state->skip = 3;
+            states[n].loop = 1;
+            memset(states[n++].class, 0xff, sizeof(state->class));
+            glob_class_set(&states[n++], '/');
+            p += 3;
+        } else if (p[0] == '*' && p[1] == '*') {
+            state->loop = 1;
+            memset(state->class, 0xff, sizeof(state->class));
+            p += 2;
+        } else if (*p == '*' || *p == '?') {
+            state->loop = *p == '*';
+            memset(state->class, 0xff, sizeof(state->class));
+            state->class['/' >> 6] &= ~(1ULL << ('/' & 63));
+            p++;
+        } else if (*p == '[' && strchr(p + 1, ']') != NULL) {
+            p++;
+            negate = *p == '!' || *p == '^';
+            if (negate)
+                p++;
+            /* A leading ']' is part of the class */
+            do {
+                if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+                    for (c = (unsigned char) p[0]; c <= (unsigned char) p[2]; c++)
+                        glob_class_set(state, c);
+                    p += 3;
+                } else {
+                    glob_class_set(state, *p++);
+                }
+            } while (*p != ']' && *p != '\0');
+            if (*p == ']')
+                p++;
+            if (negate) {
+                for (c = 0; c < 4; c++)
+                    state->class[c] = ~state->class[c];
+            }
+            state->class['/' >> 6] &= ~(1ULL << ('/' & 63));
+        } else {
+            if (*p == '\\' && p[1] != '\0')
+                p++;
+            glob_class_set(state, *p++);
+        }
+    }
+
+    states[n++].flags = flags;
+    path_filter.n_states = n;
+    return 0;
+}
+
+static MAIN_HELPER int path_filter_add(const char *pattern, int flags) {
+    if (path_filter.nodes == NULL) {
+        path_filter.nodes = calloc(1, sizeof(path_trie_node_t));
+        path_filter.n_nodes = 1;
+        path_filter.states = calloc(PATH_FILTER_MAX_STATES, sizeof(glob_state_t));
+        if (path_filter.nodes == NULL || path_filter.states == NULL)
+            return -1;
+    }
+
+    if (flags & PATH_FILTER_INCLUDE)
+        path_filter.has_includes = 1;
+    use_path_filter = 1;
+
+    if (strpbrk(pattern, "*?[") != NULL)
+        return path_filter_add_glob(pattern, flags);
+
+    return path_filter_add_prefix(pattern, flags);
+}
+
+/* Follow loops of the states set, without consuming anything. Jumps only
+ * go forward, so a single pass is enough. */
+static void glob_closure(uint64_t *set) {
+    const glob_state_t *state;
+    uint32_t i;
+
+    for (i = 0; i < path_filter.n_states; i++) {
+        state = &path_filter.states[i];
+        if (state->loop && ((set[i >> 6] >> (i & 63)) & 1)) {
+            set[(i + 1) >> 6] |= 1ULL << ((i + 1) & 63);
+            if (state->skip)
+                set[(i + state->skip) >> 6] |= 1ULL << ((i + state->skip) & 63);
+        }
+    }
+}
+
+/* Move a set of states past a byte, returns whether any state is left */
+static int glob_step(const uint64_t *set, unsigned char c, uint64_t *next) {
+    const uint64_t *byte_states = &path_filter.byte_states[c * path_filter.n_words];
+    const uint64_t *target;
+    uint32_t n_words = path_filter.n_words;
+    uint32_t word;
+    uint32_t j;
+    uint64_t bits;
+    int any = 0;
+
+    memset(next, 0, n_words * sizeof(*next));
+    for (word = 0; word < n_words; word++) {
+        for (bits = set[word] & byte_states[word]; bits != 0; bits &= bits - 1) {
+            target = &path_filter.targets[(word * 64 + __builtin_ctzll(bits)) * n_words];
+            for (j = 0; j < n_words; j++)
+                next[j] |= target[j];
+            any = 1;
+        }
+    }
+
+    return any;
+}
+
+/* Rules of the final states in a set */
+static int glob_flags(const uint64_t *set) {
+    uint64_t bits;
+    uint32_t word;
+    int flags = 0;
+
+    for (word = 0; word < path_filter.n_words; word++) {
+        for (bits = set[word]; bits != 0; bits &= bits - 1)
+            flags |= path_filter.states[word * 64 + __builtin_ctzll(bits)].flags;
+    }
+
+    return flags;
+}
+
+/* Turn the globs into a DFA by following every set of states they can be
+ * in, gives up past PATH_FILTER_MAX_DFA_STATES of them */
+static void path_filter_build_dfa(void) {
+    uint32_t n_words = path_filter.n_words;
+    size_t set_size = n_words * sizeof(uint64_t);
+    uint32_t *index;
+    uint64_t *sets;
+    uint32_t n_dfa = 2;
+    uint32_t hash;
+    uint32_t slot;
+    uint32_t i;
+    uint32_t j;
+    int c;
+
+    sets = calloc(PATH_FILTER_MAX_DFA_STATES, set_size);
+    index = calloc(2 * PATH_FILTER_MAX_DFA_STATES, sizeof(*index));
+    path_filter.dfa = malloc(PATH_FILTER_MAX_DFA_STATES * 256 * sizeof(uint32_t));
+    path_filter.dfa_flags = calloc(PATH_FILTER_MAX_DFA_STATES, 1);
+    if (sets == NULL || index == NULL || path_filter.dfa == NULL || path_filter.dfa_flags == NULL)
+        goto fail;
+
+    /* State 0 is the empty set, state 1 the initial one. The index holds
+     * states plus one. */
+    memcpy(&sets[n_words], path_filter.start, set_size);
+    hash = string_hash((const char *) path_filter.start, set_size);
+    index[hash & (2 * PATH_FILTER_MAX_DFA_STATES - 1)] = 2;
+
+    for (i = 0; i < n_dfa; i++) {
+        path_filter.dfa_flags[i] = glob_flags(&sets[i * n_words]);
+
+        for (c = 0; c < 256; c++) {
+            if (i == 0 || !glob_step(&sets[i * n_words], c, &sets[n_dfa * n_words])) {
+                path_filter.dfa[i * 256 + c] = 0;
+                continue;
+            }
+
+            hash = string_hash((const char *) &sets[n_dfa * n_words], set_size);
+            for (slot = hash & (2 * PATH_FILTER_MAX_DFA_STATES - 1);
+                 (j = index[slot]) != 0 &&
+                 memcmp(&sets[(j - 1) * n_words], &sets[n_dfa * n_words], set_size) != 0;
+                 slot = (slot + 1) & (2 * PATH_FILTER_MAX_DFA_STATES - 1));
+
+            if (j == 0) {
+                if (n_dfa + 1 >= PATH_FILTER_MAX_DFA_STATES)
+                    goto fail;
+                j = index[slot] = ++n_dfa;
+            }
+            path_filter.dfa[i * 256 + c] = j - 1;
+        }
+    }
+
+    free(sets);
+    free(index);
+    return;
+
+fail:
+    free(sets);
+    free(index);
+    free(path_filter.dfa);
+    free(path_filter.dfa_flags);
+    path_filter.dfa = NULL;
+    path_filter.dfa_flags = NULL;
+}
+
+/* Precompute the sets matching walks through, once all patterns are in */
+static MAIN_HELPER int path_filter_compile(void) {
+    const glob_state_t *state;
+    uint32_t n_words = (path_filter.n_states + 63) / 64;
+    uint32_t target;
+    uint32_t i;
+    int c;
+
+    path_filter.n_words = n_words;
+    if (n_words == 0)
+        return 0;
+
+    if ((path_filter.start = calloc(n_words, sizeof(uint64_t))) == NULL ||
+        (path_filter.byte_states = calloc(256 * n_words, sizeof(uint64_t))) == NULL ||
+        (path_filter.targets = calloc(path_filter.n_states * n_words, sizeof(uint64_t))) == NULL)
+        return -1;
+
+    /* Every glob starts at its first state, right after the end of the
+     * previous one */
+    path_filter.start[0] = 1;
+    for (i = 0; i + 1 < path_filter.n_states; i++) {
+        if (path_filter.states[i].flags)
+            path_filter.start[(i + 1) >> 6] |= 1ULL << ((i + 1) & 63);
+    }
+    glob_closure(path_filter.start);
+
+    for (i = 0; i < path_filter.n_states; i++) {
+        state = &path_filter.states[i];
+        for (c = 0; c < 256; c++) {
+            if (glob_class_has(state, c))
+                path_filter.byte_states[c * n_words + (i >> 6)] |= 1ULL << (i & 63);
+        }
+
+        target = state->loop ? i : i + 1;
+        if (target < path_filter.n_states) {
+            path_filter.targets[i * n_words + (target >> 6)] |= 1ULL << (target & 63);
+            glob_closure(&path_filter.targets[i * n_words]);
+        }
+    }
+
+    path_filter_build_dfa();
+    return 0;
+}
+
+/* Rules matched by a path */
+static int path_filter_match(const char *path) {
+    uint64_t set[PATH_FILTER_MAX_STATES / 64];
+    uint64_t next[PATH_FILTER_MAX_STATES / 64];
+    const path_trie_node_t *nodes = path_filter.nodes;
+    uint32_t n_words = path_filter.n_words;
+    uint32_t node = 0;
+    uint32_t state;
+    const char *p;
+    int flags = 0;
+
+    /* Prefixes match up to a component boundary */
+    for (p = path; ; p++) {
+        if (*p == '/' || *p == '\0')
+            flags |= nodes[node].flags;
+        if (*p == '\0')
+            break;
+        for (node = nodes[node].child;
+             node != 0 && nodes[node].byte != (unsigned char) *p;
+             node = nodes[node].sibling);
+        if (node == 0)
+            break;
+    }
+
+    if ((flags & PATH_FILTER_DROP) || n_words == 0)
+        return flags;
+
+    if (path_filter.dfa != NULL) {
+        for (p = path, state = 1; *p != '\0' && state != 0; p++)
+            state = path_filter.dfa[state * 256 + (unsigned char) *p];
+
+        return flags | path_filter.dfa_flags[state];
+    }
+
+    /* All globs at once */
+    memcpy(set, path_filter.start, n_words * sizeof(*set));
+    for (p = path; *p != '\0'; p++) {
+        if (!glob_step(set, *p, next))
+            return flags;
+        memcpy(set, next, n_words * sizeof(*set));
+    }
+
+    return flags | glob_flags(set);
+}
+
+/* Whether events on a path are reported */
+static int path_filter_accepts(const char *path) {
+    int flags;
+
+    /* Without a path, only an include rule could have told */
+    if (path == NULL)
+        return !path_filter.has_includes;
+
+    flags = path_filter_match(path);
+    if (flags & PATH_FILTER_DROP)
+        return 0;
+
+    return !path_filter.has_includes || (flags & PATH_FILTER_INCLUDE);
+}
+
+/* Parse a process rule, "kind:value" */
+static MAIN_HELPER int process_filter_add(const char *rule, int flags) {
+    static const char *kinds[PROCESS_RULE_MAX] = {"exe", "cmdline", "uid", "cgroup", "tree"};
+    process_rule_t *rules;
+    process_rule_t *new_rule;
+    struct passwd *passwd;
+    const char *value;
+    char *end;
+    int kind;
+
+    if ((value = strchr(rule, ':')) == NULL)
+        return -1;
+    for (kind = 0; kind < PROCESS_RULE_MAX; kind++) {
+        if (strlen(kinds[kind]) == (size_t) (value - rule) &&
+            strncmp(rule, kinds[kind], value - rule) == 0)
+            break;
+    }
+    if (kind == PROCESS_RULE_MAX)
+        return -1;
+    value++;
+
+    if ((rules = realloc(process_filter.rules,
+                         (process_filter.n_rules + 1) * sizeof(*rules))) == NULL)
+        return -1;
+    process_filter.rules = rules;
+    new_rule = &rules[process_filter.n_rules];
+    memset(new_rule, 0, sizeof(*new_rule));
+    new_rule->kind = kind;
+    new_rule->flags = flags;
+    new_rule->value = value;
+
+    switch (kind) {
+    case PROCESS_RULE_CMDLINE:
+        if (regcomp(&new_rule->regex, value, REG_EXTENDED | REG_NOSUB) != 0)
+            return -1;
+        break;
+    case PROCESS_RULE_UID:
+        new_rule->number = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0') {
+            if ((passwd = getpwnam(value)) == NULL)
+                return -1;
+            new_rule->number = passwd->pw_uid;
+        }
+        break;
+    case PROCESS_RULE_TREE:
+        new_rule->number = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || new_rule->number <= 0)
+            return -1;
+        break;
+    default:
+        break;
+    }
+
+    if (flags & PATH_FILTER_INCLUDE)
+        process_filter.has_includes = 1;
+    process_filter.n_rules++;
+    return 0;
+}
+
+/* Parent of a process, -1 if unknown */
+static int get_ppid_from_pid(int pid) {
+    char buffer[PID_STAT_BUFFER_SIZE];
+    char *aux;
+    ssize_t len;
+    int ppid;
+    int fd;
+
+    sprintf(buffer, "/proc/%d/stat", pid);
+    if ((fd = open(buffer, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+    buffer[len] = '\0';
+
+    /* Field 4, after comm and state */
+    if ((aux = strrchr(buffer, ')')) == NULL ||
+        sscanf(aux + 1, " %*c %d", &ppid) != 1)
+        return -1;
+
+    return ppid;
+}
+
+/* Whether the cgroup of a process is within the given one */
+static int process_in_cgroup(int pid, const char *cgroup) {
+    char buffer[PATH_MAX];
+    size_t len = strlen(cgroup);
+    char *line;
+    char *path;
+    char *saveptr;
+    ssize_t read_len;
+    int fd;
+
+    while (len > 1 && cgroup[len - 1] == '/')
+        len--;
+
+    sprintf(buffer, "/proc/%d/cgroup", pid);
+    if ((fd = open(buffer, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    read_len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (read_len <= 0)
+        return 0;
+    buffer[read_len] = '\0';
+
+    /* "hierarchy:controllers:path" lines, a single "0::path" with v2 */
+    for (line = strtok_r(buffer, "\n", &saveptr);
+         line != NULL;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        if ((path = strchr(line, ':')) == NULL || (path = strchr(path + 1, ':')) == NULL)
+            continue;
+        path++;
+        if (strncmp(path, cgroup, len) == 0 &&
+            (path[len] == '\0' || path[len] == '/' || (len == 1 && cgroup[0] == '/')))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Evaluate the rules against a process, only reading from /proc what they
+ * need. Rules never match what can't be read anymore. */
+static int process_filter_evaluate(int pid, const char *cmdline, size_t cmdline_len) {
+    char exe[PATH_MAX];
+    char joined[PATH_MAX];
+    char proc_path[32];
+    process_rule_t *rule;
+    struct stat st;
+    const char *name;
+    ssize_t exe_len = 0;
+    int have_stat = 0;
+    int matched;
+    int included = 0;
+    int ancestor;
+    int depth;
+    size_t i;
+    int j;
+
+    for (j = 0; j < process_filter.n_rules; j++) {
+        rule = &process_filter.rules[j];
+        matched = 0;
+
+        switch (rule->kind) {
+        case PROCESS_RULE_EXE:
+            if (exe_len == 0) {
+                sprintf(proc_path, "/proc/%d/exe", pid);
+                if ((exe_len = readlink(proc_path, exe, sizeof(exe) - 1)) < 0)
+                    exe_len = -1;
+                else
+                    exe[exe_len] = '\0';
+            }
+            if (exe_len > 0) {
+                name = strchr(rule->value, '/') ? exe : strrchr(exe, '/') + 1;
+                matched = strcmp(name, rule->value) == 0;
+            }
+            break;
+        case PROCESS_RULE_CMDLINE:
+            if (cmdline != NULL) {
+                for (i = 0; i < cmdline_len && i < sizeof(joined) - 1; i++)
+                    joined[i] = cmdline[i] ? cmdline[i] : ' ';
+                while (i > 0 && joined[i - 1] == ' ')
+                    i--;
+                joined[i] = '\0';
+                matched = regexec(&rule->regex, joined, 0, NULL, 0) == 0;
+            }
+            break;
+        case PROCESS_RULE_UID:
+            if (have_stat == 0) {
+                sprintf(proc_path, "/proc/%d", pid);
+                have_stat = stat(proc_path, &st) == 0 ? 1 : -1;
+            }
+            matched = have_stat > 0 && st.st_uid == (uid_t) rule->number;
+            break;
+        case PROCESS_RULE_CGROUP:
+            matched = process_in_cgroup(pid, rule->value);
+            break;
+        case PROCESS_RULE_TREE:
+            for (ancestor = pid, depth = 0;
+                 ancestor > 0 && depth < PROCESS_TREE_MAX_DEPTH;
+                 ancestor = get_ppid_from_pid(ancestor), depth++) {
+                if (ancestor == rule->number) {
+                    matched = 1;
+                    break;
+                }
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (matched && (rule->flags & PATH_FILTER_DROP))
+            return 0;
+        if (matched)
+            included = 1;
+    }
+
+    return !process_filter.has_includes || included;
+}
+
+/* Whether events of a process are reported, evaluated once per process
+ * while its cache entry lives, or once per read batch without one */
+static int process_filter_accepts(pid_cache_t *cache, int pid, const char *cmdline, size_t cmdline_len) {
+    process_verdict_t *verdict;
+    pid_cache_entry_t *entry;
+    int accepts;
+
+    if (cache->n_superseded == 0 ||
+        (entry = pid_cache_superseded(cache, pid)) == NULL)
+        entry = pid_cache_slot(cache, pid);
+    if (entry->pid == pid && entry->verdict != 0)
+        return entry->verdict > 0;
+
+    verdict = &cache->verdicts[(unsigned int) pid & (PROCESS_VERDICT_SIZE - 1)];
+    if (entry->pid != pid &&
+        verdict->pid == pid &&
+        verdict->generation == cache->generation &&
+        verdict->verdict != 0)
+        return verdict->verdict > 0;
+
+    accepts = process_filter_evaluate(pid, cmdline, cmdline_len);
+    if (entry->pid == pid) {
+        entry->verdict = accepts ? 1 : -1;
+    } else {
+        verdict->pid = pid;
+        verdict->verdict = accepts ? 1 : -1;
+        verdict->generation = cache->generation;
+    }
+
+    return accepts;
+}
+
+/* Write a capture record made of a header and up to two strings, padded
+ * to a multiple of 8 bytes */
+static void capture_write(binary_record_t *header,
+                          size_t header_size,
+                          const char *first,
+                          size_t first_len,
+                          const char *second,
+                          size_t second_len) {
+    static const char padding[8];
+    size_t len = header_size + first_len + second_len;
+
+    header->len = (len + 7) & ~7;
+    fwrite(header, header_size, 1, capture.file);
+    fwrite(first, 1, first_len, capture.file);
+    fwrite(second, 1, second_len, capture.file);
+    fwrite(padding, 1, header->len - len, capture.file);
+}
+
+static void capture_batch(const char *buffer, size_t length, const batch_time_t *batch) {
+    capture_batch_t record;
+
+    memset(&record, 0, sizeof(record));
+    record.header.type = CAPTURE_RECORD_BATCH;
+    record.realtime_ns = (uint64_t) batch->realtime.tv_sec * 1000000000ULL + batch->realtime.tv_nsec;
+    record.monotonic_ns = (uint64_t) batch->monotonic.tv_sec * 1000000000ULL + batch->monotonic.tv_nsec;
+    record.length = length;
+    capture_write(&record.header, sizeof(record), buffer, length, NULL, 0);
+}
+
+static void capture_resolved(int pid, const char *path, const char *cmdline, size_t cmdline_len) {
+    capture_resolved_t record;
+
+    memset(&record, 0, sizeof(record));
+    record.header.type = CAPTURE_RECORD_RESOLVED;
+    record.pid = pid;
+    record.path_len = path ? strlen(path) : CAPTURE_UNKNOWN;
+    record.cmdline_len = cmdline ? cmdline_len : CAPTURE_UNKNOWN;
+    capture_write(&record.header,
+                  sizeof(record),
+                  path,
+                  path ? record.path_len : 0,
+                  cmdline,
+                  cmdline ? cmdline_len : 0);
+}
+
+/* Take the path and cmdline of an event from the capture being replayed,
+ * returns whether the path is known */
+static int replay_resolve(struct fanotify_event_metadata *event,
+                          char *path,
+                          const char **cmdline,
+                          size_t *cmdline_len) {
+    capture_resolved_t *record;
+    size_t path_len;
+    size_t len;
+
+    *cmdline = NULL;
+
+    record = (capture_resolved_t *) (replay.data + replay.offset);
+    if (replay.offset + sizeof(*record) > replay.size ||
+        record->header.type != CAPTURE_RECORD_RESOLVED ||
+        record->header.len < sizeof(*record) ||
+        record->header.len > replay.size - replay.offset ||
+        record->pid != event->pid)
+        return 0;
+    replay.offset += record->header.len;
+
+    path_len = record->path_len == CAPTURE_UNKNOWN ? 0 : record->path_len;
+    len = record->cmdline_len == CAPTURE_UNKNOWN ? 0 : record->cmdline_len;
+    if (path_len >= PATH_MAX || sizeof(*record) + path_len + len > record->header.len)
+        return 0;
+
+    if (record->cmdline_len != CAPTURE_UNKNOWN) {
+        *cmdline = (const char *) (record + 1) + path_len;
+        *cmdline_len = len;
+    }
+
+    if (record->path_len == CAPTURE_UNKNOWN)
+        return 0;
+
+    memcpy(path, record + 1, path_len);
+    path[path_len] = '\0';
+    return 1;
+}
+
+/* Format a record in the output format chosen */
+static void event_output(output_t *out,
+                         int pid,
+                         uint64_t mask,
+                         const char *path,
+                         const char *cmdline,
+                         size_t cmdline_len,
+                         unsigned long long lag,
+                         unsigned int count) {
+    /* Records are only written whole, so those of several workers never
+     * mix */
+    if (out->len + OUTPUT_RECORD_MAX_SIZE > OUTPUT_BUFFER_SIZE)
+        output_flush(out);
+
+    if (use_binary)
+        output_append_binary_event(out, pid, mask, path, cmdline, cmdline_len, lag, count);
+    else if (use_json)
+        output_append_json_event(out, pid, mask, path, cmdline, cmdline_len, lag, count);
+    else
+        output_append_event(out,
+                            pid,
+                            mask,
+                            path ? path : "unknown",
+                            cmdline ? cmdline : "unknown",
+                            cmdline ? cmdline_len : 7,
+                            lag,
+                            count);
+}
+
+/* Time coalescing windows are measured in, the captured one on replay */
+static uint64_t coalesce_now(const output_t *out) {
+    return (uint64_t) out->batch.monotonic.tv_sec * 1000000000ULL + out->batch.monotonic.tv_nsec;
+}
+
+/* Write out a pending record, with the read time of its first event */
+static void coalesce_emit(output_t *out, int index) {
+    coalesce_table_t *table = &out->coalesced;
+    coalesce_entry_t *entry = &table->entries[index];
+    batch_time_t batch = out->batch;
+
+    out->batch = entry->batch;
+    event_output(out,
+                 entry->pid,
+                 entry->mask,
+                 entry->path,
+                 entry->cmdline,
+                 entry->cmdline_len,
+                 entry->lag,
+                 entry->count);
+    out->batch = batch;
+
+    atomic_fetch_add_explicit(&read_stats.coalesced, entry->count - 1, memory_order_relaxed);
+    free(entry->path);
+    free(entry->cmdline);
+    table->n_entries--;
+    memmove(entry, entry + 1, (table->n_entries - index) * sizeof(*entry));
+}
+
+/* Write out the records whose window elapsed by now, all of them with
+ * UINT64_MAX */
+static void coalesce_expire(output_t *out, uint64_t now) {
+    coalesce_table_t *table = &out->coalesced;
+
+    while (table->n_entries > 0 && table->entries[0].start + coalesce.window <= now)
+        coalesce_emit(out, 0);
+}
+
+/* The coalescing timer ticked */
+static void coalesce_tick(output_t *out) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    coalesce_expire(out, (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec);
+    output_flush(out);
+}
+
+/* Merge an event into the pending record of its process and file, or
+ * start one. Returns 0 if the event is to be written on its own. */
+static int coalesce_event(output_t *out,
+                          int pid,
+                          uint64_t mask,
+                          const char *path,
+                          const char *cmdline,
+                          size_t cmdline_len,
+                          unsigned long long lag) {
+    coalesce_table_t *table = &out->coalesced;
+    coalesce_entry_t *entry;
+    size_t len = strlen(path);
+    uint32_t hash = string_hash(path, len);
+    int i;
+
+    /* Few records are pending at a time, a scan is enough */
+    for (i = 0; i < table->n_entries; i++) {
+        entry = &table->entries[i];
+        if (entry->pid != pid || entry->hash != hash || strcmp(entry->path, path) != 0)
+            continue;
+
+        /* A close ends the record, anything else comes after it */
+        if (!(mask & ~COALESCE_MASK) || (mask & FAN_CLOSE)) {
+            entry->mask |= mask;
+            entry->count++;
+            if (mask & FAN_CLOSE)
+                coalesce_emit(out, i);
+            return 1;
+        }
+        coalesce_emit(out, i);
+        return 0;
+    }
+
+    if (mask & ~COALESCE_MASK)
+        return 0;
+
+    if (table->n_entries == COALESCE_MAX_ENTRIES)
+        coalesce_emit(out, 0);
+
+    entry = &table->entries[table->n_entries];
+    if ((entry->path = strndup(path, len)) == NULL)
+        return 0;
+    entry->cmdline = NULL;
+    entry->cmdline_len = 0;
+    if (cmdline != NULL && (entry->cmdline = cmdline_dup(cmdline, cmdline_len)) != NULL)
+        entry->cmdline_len = cmdline_len;
+    entry->pid = pid;
+    entry->hash = hash;
+    entry->mask = mask;
+    entry->count = 1;
+    entry->lag = lag;
+    entry->batch = out->batch;
+    entry->start = coalesce_now(out);
+    table->n_entries++;
+    return 1;
+}
+
+static void event_process(pid_cache_t *cache, output_t *out, struct fanotify_event_metadata *event) {
+    char path[PATH_MAX];
+    const struct timespec *read_time;
+    struct timespec now;
+    const char *cmdline = NULL;
+    size_t cmdline_len = 0;
+    long long lag;
+    int resolved;
+    uint64_t start;
+    uint64_t resolved_time;
+
+    start = metrics_now();
+
+    /* Our own output and capture files are none of our business */
+    if (event->pid == self_pid) {
+        atomic_fetch_add_explicit(&read_stats.process_filtered, 1, memory_order_relaxed);
+        if (capture.file != NULL)
+            capture_resolved(event->pid, NULL, NULL, 0);
+        goto out;
+    }
+
+    /* Overflows only mark where events were lost in the output */
+    if (event->mask & FAN_Q_OVERFLOW) {
+        resolved = 0;
+    } else if (replay.data != NULL) {
+        resolved = replay_resolve(event, path, &cmdline, &cmdline_len);
+    } else if (use_fid) {
+        resolved = get_file_path_from_fid(event, path, PATH_MAX) != NULL;
+
+        /* Cached directory paths go stale once a directory moves */
+        if (event->mask & (FAN_MOVE_SELF | FAN_DELETE_SELF))
+            fid_cache_flush(&fid_cache);
+        else if (resolved &&
+                 (event->mask & FAN_ONDIR) &&
+                 (event->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE)))
+            fid_cache_invalidate(&fid_cache, path);
+    } else {
+        resolved = get_file_path_from_fd(event->fd, path, PATH_MAX) != NULL;
+    }
+
+    resolved_time = metrics_now();
+    histogram_add(METRIC_PATH_LOOKUP, resolved_time - start);
+
+    /* Filtered events are dropped before any further lookup */
+    if (use_path_filter &&
+        !(event->mask & FAN_Q_OVERFLOW) &&
+        !path_filter_accepts(resolved ? path : NULL)) {
+        atomic_fetch_add_explicit(&read_stats.filtered, 1, memory_order_relaxed);
+        /* Replays may use other filters */
+        if (capture.file != NULL)
+            capture_resolved(event->pid, resolved ? path : NULL, NULL, 0);
+        goto out;
+    }
+
+    if (!(event->mask & FAN_Q_OVERFLOW) && replay.data == NULL) {
+        cmdline = pid_cache_get_cmdline(cache, event->pid, &cmdline_len);
+        histogram_add(METRIC_CMDLINE_LOOKUP, metrics_now() - resolved_time);
+    }
+
+    if (capture.file != NULL && !(event->mask & FAN_Q_OVERFLOW))
+        capture_resolved(event->pid, resolved ? path : NULL, cmdline, cmdline_len);
+
+    if (process_filter.n_rules > 0 &&
+        !(event->mask & FAN_Q_OVERFLOW) &&
+        !process_filter_accepts(cache, event->pid, cmdline, cmdline_len)) {
+        atomic_fetch_add_explicit(&read_stats.process_filtered, 1, memory_order_relaxed);
+        goto out;
+    }
+
+    /* Lag is the time the event waited since it was read, or since its
+     * batch was taken from the capture */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    read_time = replay.data != NULL ? &replay.start : &out->batch.monotonic;
+    lag = (now.tv_sec - read_time->tv_sec) * 1000000000LL +
+          (now.tv_nsec - read_time->tv_nsec);
+    if (lag < 0)
+        lag = 0;
+    histogram_add(METRIC_EVENT_LAG, lag);
+
+    /* Repeated reads and writes only show up once their file is closed
+     * or the window elapsed */
+    if (coalesce.window == 0 ||
+        !resolved ||
+        (event->mask & FAN_Q_OVERFLOW) ||
+        !coalesce_event(out, event->pid, event->mask, path, cmdline, cmdline_len, lag))
+        event_output(out,
+                     event->pid,
+                     event->mask,
+                     resolved ? path : NULL,
+                     cmdline,
+                     cmdline_len,
+                     lag,
+                     1);
+
+out:
+    /* Filtered events are timed too */
+    if (event->fd >= 0)
+        close(event->fd);
+
+    histogram_add(METRIC_EVENT_PROCESS, metrics_now() - start);
+}
+
+static void proc_event_process(pid_cache_t *cache, proc_record_t *record) {
+    struct proc_event *event = &record->event;
+    char buffer[PATH_MAX];
+    pid_cache_entry_t *entry;
+    ssize_t len;
+
+    switch (event->what) {
+    case PROC_EVENT_FORK:
+        /* Threads share the process entry */
+        if (event->event_data.fork.child_pid != event->event_data.fork.child_tgid)
+            break;
+        /* Child runs the same cmdline as its parent until it execs */
+        entry = pid_cache_slot(cache, event->event_data.fork.parent_tgid);
+        if (entry->pid != 0 && entry->cmdline != NULL) {
+            len = entry->cmdline_len;
+            pid_cache_set(cache,
+                          event->event_data.fork.child_tgid,
+                          cmdline_dup(entry->cmdline, len),
+                          len);
+            break;
+        }
+        /* Parent unknown (or owned by another worker), read it from the
+         * child while it's still around */
+        len = get_program_cmdline_from_pid(event->event_data.fork.child_tgid,
+                                           buffer,
+                                           PATH_MAX);
+        pid_cache_set(cache,
+                      event->event_data.fork.child_tgid,
+                      len > 0 ? cmdline_dup(buffer, len) : NULL,
+                      len);
+        break;
+
+    case PROC_EVENT_EXEC:
+        /* Cmdline captured by the proc connector thread */
+        len = record->cmdline_len;
+        pid_cache_set(cache,
+                      event->event_data.exec.process_tgid,
+                      len > 0 ? cmdline_dup(record->cmdline, len) : NULL,
+                      len);
+        break;
+
+    case PROC_EVENT_EXIT:
+        if (event->event_data.exit.process_pid != event->event_data.exit.process_tgid)
+            break;
+        /* Keep the entry until the queued events of the process are done */
+        entry = pid_cache_slot(cache, event->event_data.exit.process_tgid);
+        if (entry->pid != 0 && !entry->exited) {
+            entry->exited = 1;
+            entry->generation = cache->generation;
+            cache->n_exited++;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void read_stats_add(unsigned long long n_events, unsigned long long n_overflows) {
+    histogram_add(METRIC_READ_BATCH, n_events);
+    read_stats.reads++;
+    read_stats.overflows += n_overflows;
+    read_stats.events += n_events;
+    if (n_events > read_stats.max_events)
+        read_stats.max_events = n_events;
+}
+
+/* Wake up the reader if it flagged it's sleeping */
+static void pipeline_wake_reader(void) {
+    if (atomic_load(&pipeline.reader_waiting) &&
+        atomic_exchange(&pipeline.reader_waiting, 0))
+        eventfd_write(pipeline.reader_fd, 1);
+}
+
+/* Make the records pushed so far visible to the worker */
+static void event_ring_publish(event_ring_t *ring) {
+    if (atomic_load_explicit(&ring->head, memory_order_relaxed) == ring->pending_head)
+        return;
+
+    atomic_store(&ring->head, ring->pending_head);
+    if (atomic_load(&ring->worker_waiting) &&
+        atomic_exchange(&ring->worker_waiting, 0))
+        eventfd_write(ring->worker_fd, 1);
+}
+
+static int event_ring_has_room(event_ring_t *ring, uint64_t len) {
+    return ring->pending_head + len - atomic_load(&ring->tail) <= ring->size;
+}
+
+/* Append a record of the given length (multiple of 8), waiting for the
+ * worker to make room if needed. Published with event_ring_publish(). */
+static ring_record_t *event_ring_reserve(event_ring_t *ring, uint32_t len, uint32_t type) {
+    ring_record_t *record;
+    eventfd_t value;
+    uint64_t offset;
+    uint32_t padding;
+
+    /* Records are contiguous, skip the end of the ring if needed */
+    offset = ring->pending_head & (ring->size - 1);
+    padding = offset + len > ring->size ? (uint32_t) (ring->size - offset) : 0;
+
+    while (!event_ring_has_room(ring, padding + len)) {
+        event_ring_publish(ring);
+        atomic_store(&pipeline.reader_waiting, 1);
+        if (event_ring_has_room(ring, padding + len)) {
+            atomic_store(&pipeline.reader_waiting, 0);
+            break;
+        }
+        eventfd_read(pipeline.reader_fd, &value);
+    }
+
+    if (padding > 0) {
+        record = (ring_record_t *) (ring->data + offset);
+        record->len = padding;
+        record->type = RING_RECORD_PADDING;
+        ring->pending_head += padding;
+    }
+
+    record = (ring_record_t *) (ring->data + (ring->pending_head & (ring->size - 1)));
+    record->len = len;
+    record->type = type;
+    ring->pending_head += len;
+
+    return record;
+}
+
+/* Worker owning the given PID, so that events of a process stay ordered */
+static event_ring_t *pipeline_ring(int pid) {
+    return &pipeline.workers[(unsigned int) pid % (unsigned int) pipeline.n_workers].ring;
+}
+
+/* Queue a record without payload to every worker */
+static void pipeline_push_all(uint32_t type) {
+    int i;
+
+    for (i = 0; i < pipeline.n_workers; ++i) {
+        event_ring_reserve(&pipeline.workers[i].ring, sizeof(ring_record_t), type);
+        event_ring_publish(&pipeline.workers[i].ring);
+    }
+}
+
+/* Copy the events of a read() batch into the rings of their workers */
+static void pipeline_push_batch(char *buffer, ssize_t length) {
+    struct fanotify_event_metadata *metadata;
+    ring_record_t *record;
+    unsigned long long n_events = 0;
+    unsigned long long n_overflows = 0;
+    batch_time_t batch;
+    long n_fds = 0;
+    int i;
+
+    batch_time_get(&batch);
+    for (i = 0; i < pipeline.n_workers; ++i) {
+        record = event_ring_reserve(&pipeline.workers[i].ring,
+                                    sizeof(ring_record_t) + sizeof(batch),
+                                    RING_RECORD_BATCH);
+        memcpy(record + 1, &batch, sizeof(batch));
+    }
+
+    metadata = (struct fanotify_event_metadata *) buffer;
+    while (FAN_EVENT_OK (metadata, length)) {
+        record = event_ring_reserve(pipeline_ring(metadata->pid),
+                                    (sizeof(ring_record_t) + metadata->event_len + 7) & ~7u,
+                                    RING_RECORD_EVENT);
+        memcpy(record + 1, metadata, metadata->event_len);
+        if (metadata->fd >= 0)
+            n_fds++;
+        if (metadata->mask & FAN_Q_OVERFLOW)
+            n_overflows++;
+        metadata = FAN_EVENT_NEXT (metadata, length);
+        n_events++;
+    }
+
+    /* Workers only decrement once they closed an FD, being briefly
+     * behind here is harmless */
+    atomic_fetch_add(&pipeline.inflight_fds, n_fds);
+    for (i = 0; i < pipeline.n_workers; ++i)
+        event_ring_publish(&pipeline.workers[i].ring);
+
+    read_stats_add(n_events, n_overflows);
+}
+
+/* Queue a proc connector event to the worker owning the process */
+static void pipeline_push_proc_event(proc_record_t *proc_record) {
+    struct proc_event *event = &proc_record->event;
+    ring_record_t *record;
+    size_t len;
+    int pid;
+
+    switch (event->what) {
+    case PROC_EVENT_FORK:
+        pid = event->event_data.fork.child_tgid;
+        break;
+    case PROC_EVENT_EXEC:
+        pid = event->event_data.exec.process_tgid;
+        break;
+    case PROC_EVENT_EXIT:
+        pid = event->event_data.exit.process_tgid;
+        break;
+    default:
+        return;
+    }
+
+    len = offsetof(proc_record_t, cmdline) + (proc_record->cmdline_len > 0 ? proc_record->cmdline_len : 0);
+    record = event_ring_reserve(pipeline_ring(pid),
+                                (sizeof(ring_record_t) + len + 7) & ~7u,
+                                RING_RECORD_PROC);
+    memcpy(record + 1, proc_record, len);
+}
+
+/* Next record for the worker, sleeping until there is one */
+static ring_record_t *event_ring_next(event_ring_t *ring) {
+    ring_record_t *record;
+    eventfd_t value;
+    uint64_t tail;
+
+    for (;;) {
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (atomic_load(&ring->head) == tail) {
+            atomic_store(&ring->worker_waiting, 1);
+            if (atomic_load(&ring->head) != tail) {
+                atomic_store(&ring->worker_waiting, 0);
+                break;
+            }
+            eventfd_read(ring->worker_fd, &value);
+        }
+
+        record = (ring_record_t *) (ring->data + (tail & (ring->size - 1)));
+        if (record->type != RING_RECORD_PADDING)
+            return record;
+
+        atomic_store(&ring->tail, tail + record->len);
+    }
+}
+
+/* Give the space of a record back to the reader */
+static void event_ring_release(event_ring_t *ring, ring_record_t *record) {
+    atomic_store(&ring->tail,
+                 atomic_load_explicit(&ring->tail, memory_order_relaxed) + record->len);
+    pipeline_wake_reader();
+}
+
+/* Largest read() that keeps the FDs of queued events within budget. The
+ * kernel opens one FD per event, unless reporting file handles. */
+static size_t pipeline_read_size(void) {
+    eventfd_t value;
+    size_t wanted;
+    long available;
+
+    if (use_fid)
+        return fanotify_buffer_size;
+
+    /* Don't fall back to tiny reads when workers are behind */
+    wanted = pipeline.fd_budget / 2 * FAN_EVENT_METADATA_LEN;
+    if (wanted > fanotify_buffer_size)
+        wanted = fanotify_buffer_size;
+
+    for (;;) {
+        available = pipeline.fd_budget - atomic_load(&pipeline.inflight_fds);
+        if ((size_t) available * FAN_EVENT_METADATA_LEN >= wanted)
+            break;
+        atomic_store(&pipeline.reader_waiting, 1);
+        available = pipeline.fd_budget - atomic_load(&pipeline.inflight_fds);
+        if ((size_t) available * FAN_EVENT_METADATA_LEN >= wanted) {
+            atomic_store(&pipeline.reader_waiting, 0);
+            break;
+        }
+        eventfd_read(pipeline.reader_fd, &value);
+    }
+
+    if ((size_t) available * FAN_EVENT_METADATA_LEN < fanotify_buffer_size)
+        return (size_t) available * FAN_EVENT_METADATA_LEN;
+    return fanotify_buffer_size;
+}
+
+/* Take the records forwarded by the proc connector thread */
+static void proc_connector_process(int proc_fd) {
+    proc_record_t record;
+
+    /* Each recv() returns a single record, drain all pending ones */
+    while (recv(proc_fd, &record, sizeof(record), MSG_DONTWAIT) > 0) {
+        /* Messages were lost, cached cmdlines may be stale */
+        if (record.lost) {
+            fprintf(stderr, "Proc connector overflow, dropping process table\n");
+            if (use_pipeline)
+                pipeline_push_all(RING_RECORD_PROC_LOST);
+            else
+                pid_cache_clear(&pid_cache);
+            continue;
+        }
+
+        if (use_pipeline)
+            pipeline_push_proc_event(&record);
+        else
+            proc_event_process(&pid_cache, &record);
+    }
+
+    if (use_pipeline) {
+        int i;
+
+        for (i = 0; i < pipeline.n_workers; ++i)
+            event_ring_publish(&pipeline.workers[i].ring);
+    }
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete) {
+    int ret;
+
+    while ((ret = (int) syscall(__NR_io_uring_enter,
+                                uring.fd,
+                                to_submit,
+                                min_complete,
+                                min_complete ? IORING_ENTER_GETEVENTS : 0,
+                                NULL,
+                                0)) < 0 &&
+           errno == EINTR);
+
+    return ret;
+}
+
+/* Hand all filled in SQEs to the kernel */
+static void uring_submit(void) {
+    unsigned to_submit;
+
+    to_submit = uring.sqe_tail - *uring.sq_tail;
+    if (to_submit == 0)
+        return;
+
+    __atomic_store_n(uring.sq_tail, uring.sqe_tail, __ATOMIC_RELEASE);
+    if (uring_enter(to_submit, 0) < 0) {
+        fprintf(stderr,
+                "Couldn't submit to io_uring: '%s'\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Get an empty SQE, submitting the queued ones if the ring is full */
+static struct io_uring_sqe *uring_get_sqe(int kind, unsigned int index) {
+    struct io_uring_sqe *sqe;
+    unsigned i;
+
+    if (uring.sqe_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries)
+        uring_submit();
+
+    i = uring.sqe_tail & *uring.sq_mask;
+    sqe = &uring.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = ((uint64_t) kind << 32) | index;
+    uring.sq_array[i] = i;
+    uring.sqe_tail++;
+
+    return sqe;
+}
+
+static struct io_uring_sqe *uring_prep_read(int fd, void *buffer, unsigned len, int kind, unsigned int index) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(kind, index);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = len;
+    /* Current file position, fine for all FDs read */
+    sqe->off = (uint64_t) -1;
+
+    return sqe;
+}
+
+static void uring_dispatch(uint64_t user_data, int res) {
+    uring_prefetch_t *prefetch;
+
+    prefetch = &uring.prefetch[(user_data & 0xffffffff) % URING_MAX_PREFETCH];
+    switch (user_data >> 32) {
+    case URING_FANOTIFY:
+        uring.fanotify_done = 1;
+        uring.fanotify_result = res;
+        return;
+    case URING_SIGNAL:
+        uring.signal_done = 1;
+        uring.signal_result = res;
+        return;
+    case URING_PROC:
+        uring.proc_done = 1;
+        return;
+    case URING_TIMER:
+        uring.timer_done = 1;
+        return;
+    case URING_REAP:
+        uring.reap_done = 1;
+        return;
+    case URING_STAT_OPEN:
+        prefetch->stat_fd = res < 0 ? -1 : res;
+        break;
+    case URING_STAT_READ:
+        prefetch->stat_len = res;
+        break;
+    case URING_CMDLINE_READ:
+        prefetch->cmdline_len = res;
+        break;
+    }
+    uring.prefetch_pending--;
+}
+
+/* Wait for at least one completion, and dispatch all available */
+static void uring_wait(void) {
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned tail;
+
+    uring_submit();
+
+    head = *uring.cq_head;
+    if (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE) &&
+        uring_enter(0, 1) < 0) {
+        fprintf(stderr,
+                "Couldn't wait for io_uring: '%s'\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &uring.cqes[head & *uring.cq_mask];
+        uring_dispatch(cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Queue open, read and close of /proc/<pid>/cmdline, chained on the
+ * fixed file slot of the prefetch. Hard links keep the chain going when
+ * a step fails or a read is short. */
+static void uring_prep_cmdline(unsigned int index) {
+    uring_prefetch_t *prefetch;
+    struct io_uring_sqe *sqe;
+
+    prefetch = &uring.prefetch[index];
+    sprintf(prefetch->cmdline_path, "/proc/%d/cmdline", prefetch->pid);
+
+    sqe = uring_get_sqe(URING_PREFETCH, index);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) prefetch->cmdline_path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = index + 1;
+    sqe->flags = IOSQE_IO_HARDLINK;
+
+    sqe = uring_prep_read(index, prefetch->cmdline, PATH_MAX - 1, URING_CMDLINE_READ, index);
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+    sqe = uring_get_sqe(URING_PREFETCH, index);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = index + 1;
+
+    uring.prefetch_pending += 3;
+}
+
+static void uring_prep_stat_read(unsigned int index) {
+    uring_prefetch_t *prefetch;
+    struct io_uring_sqe *sqe;
+
+    prefetch = &uring.prefetch[index];
+    sqe = uring_prep_read(prefetch->stat_fd, prefetch->stat, PID_STAT_BUFFER_SIZE - 1, URING_STAT_READ, index);
+    sqe->off = 0;
+    uring.prefetch_pending++;
+}
+
+static void uring_prefetch_wait(void) {
+    while (uring.prefetch_pending > 0)
+        uring_wait();
+}
+
+/* Whether event_process() will look up the cmdline of an event. Only
+ * asked for processes that are not cached yet, so the path is resolved
+ * twice for those alone. */
+static int uring_prefetch_wanted(struct fanotify_event_metadata *event) {
+    char path[PATH_MAX];
+    int resolved;
+
+    if (event->pid == self_pid || (event->mask & FAN_Q_OVERFLOW))
+        return 0;
+    if (!use_path_filter)
+        return 1;
+
+    if (use_fid)
+        resolved = get_file_path_from_fid(event, path, PATH_MAX) != NULL;
+    else
+        resolved = get_file_path_from_fd(event->fd, path, PATH_MAX) != NULL;
+
+    return path_filter_accepts(resolved ? path : NULL);
+}
+
+/* Fetch the cmdlines of the processes behind a batch of events with a
+ * couple of io_uring submissions, instead of several syscalls per process.
+ * Whatever can't be prefetched is left to pid_cache_get_cmdline(). */
+static void uring_prefetch_cmdlines(pid_cache_t *cache, char *buffer, ssize_t length) {
+    struct fanotify_event_metadata *metadata;
+    uring_prefetch_t *prefetch;
+    pid_cache_entry_t *entry;
+    unsigned long long start_time;
+    unsigned long arg_start;
+    unsigned long arg_end;
+    int n = 0;
+    int i;
+
+    /* Processes that need a syscall, once each */
+    metadata = (struct fanotify_event_metadata *) buffer;
+    for (; FAN_EVENT_OK (metadata, length) && n < URING_MAX_PREFETCH;
+         metadata = FAN_EVENT_NEXT (metadata, length)) {
+        entry = pid_cache_slot(cache, metadata->pid);
+        if (entry->pid == metadata->pid &&
+            (cache->live || entry->generation == cache->generation))
+            continue;
+
+        for (i = 0; i < n && uring.prefetch[i].pid != metadata->pid; i++);
+        if (i < n || !uring_prefetch_wanted(metadata))
+            continue;
+
+        prefetch = &uring.prefetch[n++];
+        prefetch->pid = metadata->pid;
+        prefetch->cached = entry->pid == metadata->pid;
+        prefetch->stat_fd = prefetch->cached ? entry->stat_fd : -1;
+        prefetch->stat_len = -1;
+        prefetch->cmdline_len = -1;
+    }
+
+    if (n == 0)
+        return;
+
+    /* Validate cached entries, open stat of the others. With the proc
+     * connector, stat is not needed at all. */
+    for (i = 0; i < n; i++) {
+        prefetch = &uring.prefetch[i];
+        if (prefetch->cached) {
+            uring_prep_stat_read(i);
+        } else if (cache->live) {
+            uring_prep_cmdline(i);
+        } else {
+            struct io_uring_sqe *sqe;
+
+            sprintf(prefetch->stat_path, "/proc/%d/stat", prefetch->pid);
+            sqe = uring_get_sqe(URING_STAT_OPEN, i);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t) (uintptr_t) prefetch->stat_path;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            uring.prefetch_pending++;
+        }
+    }
+    uring_prefetch_wait();
+
+    /* Read stat before cmdline, so that an exec in between shows up on the
+     * next validation */
+    if (!cache->live) {
+        for (i = 0; i < n; i++) {
+            prefetch = &uring.prefetch[i];
+            if (prefetch->cached || prefetch->stat_fd < 0)
+                continue;
+            uring_prep_stat_read(i);
+            uring.sqes[(uring.sqe_tail - 1) & *uring.sq_mask].flags |= IOSQE_IO_HARDLINK;
+            uring_prep_cmdline(i);
+        }
+        uring_prefetch_wait();
+    }
+
+    for (i = 0; i < n; i++) {
+        prefetch = &uring.prefetch[i];
+        if (prefetch->stat_len > 0)
+            prefetch->stat[prefetch->stat_len] = '\0';
+
+        entry = pid_cache_slot(cache, prefetch->pid);
+        if (prefetch->cached) {
+            /* Gone if evicted meanwhile */
+            if (entry->pid != prefetch->pid)
+                continue;
+
+            if (prefetch->stat_len > 0 &&
+                parse_pid_stat(prefetch->stat, &start_time, &arg_start, &arg_end) == 0 &&
+                start_time == entry->start_time &&
+                arg_start == entry->arg_start &&
+                arg_end == entry->arg_end &&
+                arg_start != 0)
+                entry->generation = cache->generation;
+            else
+                pid_cache_remove(cache, entry);
+            continue;
+        }
+
+        if (cache->live) {
+            entry = pid_cache_add(cache, prefetch->pid);
+            if (prefetch->cmdline_len > 0 &&
+                (entry->cmdline = cmdline_dup(prefetch->cmdline, prefetch->cmdline_len)) != NULL)
+                entry->cmdline_len = prefetch->cmdline_len;
+            continue;
+        }
+
+        if (prefetch->stat_len <= 0 ||
+            prefetch->cmdline_len <= 0 ||
+            parse_pid_stat(prefetch->stat, &start_time, &arg_start, &arg_end) < 0) {
+            if (prefetch->stat_fd >= 0)
+                close(prefetch->stat_fd);
+            continue;
+        }
+
+        entry = pid_cache_add(cache, prefetch->pid);
+        entry->stat_fd = prefetch->stat_fd;
+        entry->start_time = start_time;
+        entry->arg_start = arg_start;
+        entry->arg_end = arg_end;
+        if ((entry->cmdline = cmdline_dup(prefetch->cmdline, prefetch->cmdline_len)) != NULL)
+            entry->cmdline_len = prefetch->cmdline_len;
+    }
+}
+
+/* Process all events returned by a single read() */
+static void event_batch_process(char *buffer, ssize_t length) {
+    struct fanotify_event_metadata *metadata;
+    unsigned long long n_events = 0;
+    unsigned long long n_overflows = 0;
+
+    /* Events of the batch share its read time, the captured one on
+     * replay */
+    if (replay.data != NULL)
+        output.batch = replay.batch;
+    else
+        batch_time_get(&output.batch);
+
+    if (capture.file != NULL)
+        capture_batch(buffer, length, &output.batch);
+
+    /* Cached cmdlines get revalidated once per batch */
+    pid_cache.generation++;
+    if (use_uring)
+        uring_prefetch_cmdlines(&pid_cache, buffer, length);
+
+    metadata = (struct fanotify_event_metadata *) buffer;
+    while (FAN_EVENT_OK (metadata, length)) {
+        if (metadata->mask & FAN_Q_OVERFLOW)
+            n_overflows++;
+        event_process(&pid_cache, &output, metadata);
+        metadata = FAN_EVENT_NEXT (metadata, length);
+        n_events++;
+    }
+    if (coalesce.window > 0)
+        coalesce_expire(&output, coalesce_now(&output));
+    output_flush(&output);
+
+    read_stats_add(n_events, n_overflows);
+}
+
+/* All events queued so far were read */
+static void event_queue_drained(void) {
+    if (use_pipeline) {
+        pipeline_push_all(RING_RECORD_DRAINED);
+        return;
+    }
+
+    /* Events of exited processes are done */
+    pid_cache_reap(&pid_cache);
+}
+
+/* The reap timer expired, exited processes are dropped if the queue is
+ * empty */
+static void event_queue_idle(int fanotify_fd) {
+    int pending;
+
+    if (ioctl(fanotify_fd, FIONREAD, &pending) < 0 || pending > 0)
+        return;
+
+    if (use_pipeline) {
+        pipeline_push_all(RING_RECORD_IDLE);
+        return;
+    }
+
+    pid_cache_reap_idle(&pid_cache);
+}
+
+/* With an unlimited kernel queue, keep the bytes left queued under the cap
+ * by discarding the oldest events, down to half the cap. Lost events are
+ * reported as an overflow, as the kernel would with a bounded queue. */
+static void fanotify_cap_queue(int fanotify_fd) {
+    struct fanotify_event_metadata *metadata;
+    struct fanotify_event_metadata overflow;
+    unsigned long long n_dropped = 0;
+    ssize_t length;
+    int pending;
+
+    if (ioctl(fanotify_fd, FIONREAD, &pending) < 0 || (size_t) pending <= queue_cap)
+        return;
+
+    do {
+        if ((length = read(fanotify_fd, fanotify_buffer, fanotify_buffer_size)) <= 0)
+            break;
+
+        metadata = (struct fanotify_event_metadata *) fanotify_buffer;
+        while (FAN_EVENT_OK (metadata, length)) {
+            if (metadata->fd >= 0)
+                close(metadata->fd);
+            metadata = FAN_EVENT_NEXT (metadata, length);
+            n_dropped++;
+        }
+    } while (ioctl(fanotify_fd, FIONREAD, &pending) == 0 && (size_t) pending > queue_cap / 2);
+
+    read_stats.dropped += n_dropped;
+
+    memset(&overflow, 0, sizeof(overflow));
+    overflow.event_len = sizeof(overflow);
+    overflow.vers = FANOTIFY_METADATA_VERSION;
+    overflow.metadata_len = sizeof(overflow);
+    overflow.mask = FAN_Q_OVERFLOW;
+    overflow.fd = FAN_NOFD;
+    if (use_pipeline)
+        pipeline_push_batch((char *) &overflow, sizeof(overflow));
+    else
+        event_batch_process((char *) &overflow, sizeof(overflow));
+}
+
+/* Read and process pending events, or hand them over to the workers in
+ * pipeline mode. In drain mode the FD is non-blocking and reading goes on
+ * until the queue is empty, instead of going back to poll() after every
+ * read. */
+static void fanotify_read_events(int fanotify_fd) {
+    ssize_t length;
+    size_t size;
+    int n_reads;
+
+    for (n_reads = 0; n_reads < DRAIN_MAX_READS; n_reads++) {
+        size = use_pipeline ? pipeline_read_size() : fanotify_buffer_size;
+
+        /* Read from the FD. It will read all events available up to
+         * the given buffer size. */
+        if ((length = read(fanotify_fd, fanotify_buffer, size)) <= 0) {
+            if (length < 0 && errno == EAGAIN)
+                event_queue_drained();
+            return;
+        }
+
+        if (use_pipeline)
+            pipeline_push_batch(fanotify_buffer, length);
+        else
+            event_batch_process(fanotify_buffer, length);
+
+        if (queue_cap > 0)
+            fanotify_cap_queue(fanotify_fd);
+
+        if (!use_drain) {
+            if ((size_t) length < size)
+                event_queue_drained();
+            return;
+        }
+    }
+}
+
+/* Main loop on io_uring: reads of the fanotify FD and of the signalfd are
+ * queued in the ring, as well as a poll of the proc connector. Returns
+ * once asked to stop. */
+static MAIN_HELPER void uring_loop(int signal_fd, int fanotify_fd, int proc_fd) {
+    struct io_uring_sqe *sqe;
+
+    uring_prep_read(signal_fd, &uring.siginfo, sizeof(uring.siginfo), URING_SIGNAL, 0);
+    uring_prep_read(fanotify_fd, fanotify_buffer, fanotify_buffer_size, URING_FANOTIFY, 0);
+    if (coalesce.timer_fd >= 0)
+        uring_prep_read(coalesce.timer_fd, &uring.timer_ticks, sizeof(uring.timer_ticks), URING_TIMER, 0);
+    if (reap_timer_fd >= 0)
+        uring_prep_read(reap_timer_fd, &uring.reap_ticks, sizeof(uring.reap_ticks), URING_REAP, 0);
+    if (proc_fd >= 0) {
+        sqe = uring_get_sqe(URING_PROC, 0);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = proc_fd;
+        sqe->poll32_events = POLLIN;
+    }
+
+    for (;;) {
+        uring_wait();
+
+        /* Signal received? */
+        if (uring.signal_done) {
+            uring.signal_done = 0;
+            if (uring.signal_result != sizeof(uring.siginfo)) {
+                fprintf(stderr,
+                        "Couldn't read signal, wrong size read\n");
+                exit(EXIT_FAILURE);
+            }
+
+            /* Break loop if we got the expected signal */
+            if (uring.siginfo.ssi_signo == SIGINT ||
+                uring.siginfo.ssi_signo == SIGTERM) {
+                return;
+            }
+
+            fprintf(stderr,
+                    "Received unexpected signal\n");
+            uring_prep_read(signal_fd, &uring.siginfo, sizeof(uring.siginfo), URING_SIGNAL, 0);
+        }
+
+        /* Process events first, so that execs are known before the file
+         * events they caused */
+        if (uring.proc_done) {
+            uring.proc_done = 0;
+            proc_connector_process(proc_fd);
+            sqe = uring_get_sqe(URING_PROC, 0);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = proc_fd;
+            sqe->poll32_events = POLLIN;
+        }
+
+        /* fanotify-cmdline event received? The buffer is only read into
+         * again once the batch is processed. */
+        if (uring.fanotify_done) {
+            uring.fanotify_done = 0;
+            if (uring.fanotify_result < 0 &&
+                uring.fanotify_result != -EINTR &&
+                uring.fanotify_result != -EAGAIN) {
+                fprintf(stderr,
+                        "Couldn't read fanotify events: '%s'\n",
+                        strerror(-uring.fanotify_result));
+                exit(EXIT_FAILURE);
+            }
+
+            if (uring.fanotify_result > 0) {
+                event_batch_process(fanotify_buffer, uring.fanotify_result);
+                if (queue_cap > 0)
+                    fanotify_cap_queue(fanotify_fd);
+                if ((size_t) uring.fanotify_result < fanotify_buffer_size)
+                    event_queue_drained();
+            }
+            uring_prep_read(fanotify_fd, fanotify_buffer, fanotify_buffer_size, URING_FANOTIFY, 0);
+        }
+
+        /* Write out the records held back long enough */
+        if (uring.timer_done) {
+            uring.timer_done = 0;
+            coalesce_tick(&output);
+            uring_prep_read(coalesce.timer_fd, &uring.timer_ticks, sizeof(uring.timer_ticks), URING_TIMER, 0);
+        }
+
+        /* Drop exited processes while nothing happens */
+        if (uring.reap_done) {
+            uring.reap_done = 0;
+            event_queue_idle(fanotify_fd);
+            uring_prep_read(reap_timer_fd, &uring.reap_ticks, sizeof(uring.reap_ticks), URING_REAP, 0);
+        }
+    }
+}
+
+/* Only drains the fanotify FD (and the proc connector) into the rings, so
+ * that slow processing or output never backs up the kernel queue */
+static void *pipeline_reader_thread(void *arg) {
+    struct pollfd fds[5];
+    uint64_t ticks;
+
+    (void) arg;
+
+    fds[0].fd = pipeline.fanotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = pipeline.proc_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = pipeline.stop_fd;
+    fds[2].events = POLLIN;
+    fds[3].fd = coalesce.timer_fd;
+    fds[3].events = POLLIN;
+    fds[4].fd = reap_timer_fd;
+    fds[4].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 5, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr,
+                    "Couldn't poll(): '%s'\n",
+                    strerror(errno));
+            break;
+        }
+
+        if (fds[2].revents & POLLIN)
+            break;
+
+        /* Process events first, so that execs are queued before the file
+         * events they caused */
+        if (fds[1].revents & POLLIN)
+            proc_connector_process(pipeline.proc_fd);
+
+        if (fds[0].revents & POLLIN)
+            fanotify_read_events(pipeline.fanotify_fd);
+
+        /* Workers write out the records they held back long enough */
+        if ((fds[3].revents & POLLIN) &&
+            read(fds[3].fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+            pipeline_push_all(RING_RECORD_TICK);
+
+        if ((fds[4].revents & POLLIN) &&
+            read(fds[4].fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+            event_queue_idle(pipeline.fanotify_fd);
+    }
+
+    /* Let the workers finish what is already queued */
+    pipeline_push_all(RING_RECORD_STOP);
+
+    return NULL;
+}
+
+/* Resolves, formats and prints the events queued by the reader for the
+ * PIDs owned by this worker */
+static void *pipeline_worker_thread(void *arg) {
+    struct fanotify_event_metadata *metadata;
+    worker_t *worker = arg;
+    ring_record_t *record;
+    uint32_t type;
+
+    do {
+        /* Write out what was formatted before waiting for more */
+        if (atomic_load(&worker->ring.head) == atomic_load_explicit(&worker->ring.tail, memory_order_relaxed))
+            output_flush(worker->output);
+
+        record = event_ring_next(&worker->ring);
+        type = record->type;
+
+        switch (type) {
+        case RING_RECORD_BATCH:
+            /* Cached cmdlines get revalidated once per batch */
+            worker->pid_cache->generation++;
+            memcpy(&worker->output->batch, record + 1, sizeof(batch_time_t));
+            if (coalesce.window > 0)
+                coalesce_expire(worker->output, coalesce_now(worker->output));
+            break;
+
+        case RING_RECORD_EVENT:
+            metadata = (struct fanotify_event_metadata *) (record + 1);
+            event_process(worker->pid_cache, worker->output, metadata);
+            if (metadata->fd >= 0)
+                atomic_fetch_sub(&pipeline.inflight_fds, 1);
+            break;
+
+        case RING_RECORD_PROC:
+            proc_event_process(worker->pid_cache, (proc_record_t *) (record + 1));
+            break;
+
+        case RING_RECORD_PROC_LOST:
+            pid_cache_clear(worker->pid_cache);
+            break;
+
+        case RING_RECORD_DRAINED:
+            /* Events of exited processes are done */
+            pid_cache_reap(worker->pid_cache);
+            break;
+
+        case RING_RECORD_TICK:
+            coalesce_tick(worker->output);
+            break;
+
+        case RING_RECORD_IDLE:
+            pid_cache_reap_idle(worker->pid_cache);
+            break;
+
+        default:
+            break;
+        }
+
+        event_ring_release(&worker->ring, record);
+    } while (type != RING_RECORD_STOP);
+
+    coalesce_expire(worker->output, UINT64_MAX);
+    output_flush(worker->output);
+    return NULL;
+}
+
+static MAIN_HELPER void shutdown_event_buffer(void) {
+    munmap(fanotify_buffer, fanotify_buffer_size);
+}
+
+static MAIN_HELPER int initialize_event_buffer(void) {
+    void *buffer = MAP_FAILED;
+
+    /* Prefer explicit huge pages for large buffers, fall back to
+     * transparent ones */
+    if (fanotify_buffer_size % HUGE_PAGE_SIZE == 0)
+        buffer = mmap(NULL,
+                      fanotify_buffer_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                      -1,
+                      0);
+
+    if (buffer == MAP_FAILED) {
+        if ((buffer = mmap(NULL,
+                           fanotify_buffer_size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1,
+                           0)) == MAP_FAILED) {
+            fprintf(stderr,
+                    "Couldn't allocate event buffer: '%s'\n",
+                    strerror(errno));
+            return -1;
+        }
+        if (fanotify_buffer_size >= HUGE_PAGE_SIZE)
+            madvise(buffer, fanotify_buffer_size, MADV_HUGEPAGE);
+    }
+
+    fanotify_buffer = buffer;
+    return 0;
+}
+
+/* Parse a comma separated list of event names, as in the output but case
+ * and FAN_ prefix optional, "close" standing for both closes */
+static int parse_event_mask(const char *list, uint64_t *mask) {
+    const char *end;
+    uint64_t result = 0;
+    size_t len;
+    size_t i;
+
+    for (;; list = end + 1) {
+        end = strchrnul(list, ',');
+        len = end - list;
+        if (len > 4 && strncasecmp(list, "FAN_", 4) == 0) {
+            list += 4;
+            len -= 4;
+        }
+
+        if (len == 5 && strncasecmp(list, "close", 5) == 0) {
+            result |= FAN_CLOSE;
+        } else {
+            /* Names end with a space, their length counts the NUL */
+            for (i = 0; i < sizeof(event_names) / sizeof(event_names[0]); ++i) {
+                if (event_names[i].flag != FAN_Q_OVERFLOW &&
+                    event_names[i].len - 5 == len &&
+                    strncasecmp(event_names[i].name + 4, list, len) == 0)
+                    break;
+            }
+            if (i == sizeof(event_names) / sizeof(event_names[0]))
+                return -1;
+            result |= event_names[i].flag;
+        }
+
+        if (*end == '\0')
+            break;
+    }
+
+    *mask = result | FAN_ONDIR | FAN_EVENT_ON_CHILD;
+    return 0;
+}
+
+/* Split "directory=events" into the directory and its own mask, the
+ * directory is taken whole unless events follow its last '=' */
+static char *parse_monitored_path(const char *spec, uint64_t *mask) {
+    const char *events;
+
+    *mask = event_mask;
+    if ((events = strrchr(spec, '=')) == NULL ||
+        events == spec ||
+        parse_event_mask(events + 1, mask) < 0)
+        return strdup(spec);
+
+    return strndup(spec, events - spec);
+}
+
+static MAIN_HELPER void shutdown_fanotify(int fanotify_fd) {
+    int i;
+
+    for (i = 0; i < n_monitors; ++i) {
+        /* Remove the mark, using same event mask as when creating it */
+        fanotify_mark(fanotify_fd,
+                      FAN_MARK_REMOVE,
+                      monitors[i].mask,
+                      AT_FDCWD,
+                      monitors[i].path);
+        if (monitors[i].dir_fd >= 0)
+            close(monitors[i].dir_fd);
+        free(monitors[i].path);
+    }
+    free(monitors);
+    close(fanotify_fd);
+
+    fid_cache_clear(&fid_cache);
+
+    pid_cache_clear(&pid_cache);
+}
+
+/* Whether a path is a monitored directory or directly in one. Only such
+ * paths get events from our inode marks, an ignore mark deeper down would
+ * filter nothing. */
+static int exclude_is_monitored(const char *path) {
+    char *resolved;
+    char *monitored;
+    char *slash;
+    int found = 0;
+    int i;
+
+    /* Missing paths are reported when marking them */
+    if ((resolved = realpath(path, NULL)) == NULL)
+        return 1;
+
+    for (i = 0; i < n_monitors && !found; ++i) {
+        if ((monitored = realpath(monitors[i].path, NULL)) == NULL)
+            continue;
+        found = strcmp(resolved, monitored) == 0;
+        if (!found && (slash = strrchr(resolved, '/')) != NULL) {
+            *slash = '\0';
+            found = strcmp(slash == resolved ? "/" : resolved, monitored) == 0;
+            *slash = '/';
+        }
+        free(monitored);
+    }
+
+    free(resolved);
+    return found;
+}
+
+static MAIN_HELPER int initialize_fanotify(int n_paths, const char **paths) {
+    uint64_t excluded_mask = 0;
+    uint64_t dirent_mask = 0;
+    int i;
+    int fanotify_fd;
+    unsigned int flags;
+
+    /* Create new fanotify-cmdline device. In FID mode the kernel reports
+     * file handles and never opens the files for us. */
+    flags = FAN_CLOEXEC |
+            (use_fid ? FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME : 0) |
+            (use_drain ? FAN_NONBLOCK : 0);
+    fanotify_fd = fanotify_init(flags | (queue_cap > 0 ? FAN_UNLIMITED_QUEUE : 0),
+                                O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    if (fanotify_fd < 0 && errno == EPERM && queue_cap > 0) {
+        fprintf(stderr, "Not allowed to use an unlimited queue, using the default one\n");
+        queue_cap = 0;
+        fanotify_fd = fanotify_init(flags, O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    }
+    if (fanotify_fd < 0) {
+        fprintf(stderr,
+                "Couldn't setup new fanotify-cmdline device: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    /* Directory entry events keep the handle cache up to date, they are
+     * only available when reporting file handles */
+    if (use_fid)
+        dirent_mask = (FAN_MOVED_FROM |
+                       FAN_MOVED_TO |
+                       FAN_DELETE |
+                       FAN_MOVE_SELF |
+                       FAN_DELETE_SELF);
+
+    /* Allocate array of monitor setups */
+    n_monitors = n_paths;
+    monitors = malloc(n_monitors * sizeof(monitored_t));
+
+    /* Loop all input directories, setting up marks */
+    for (i = 0; i < n_monitors; ++i) {
+        monitors[i].path = parse_monitored_path(paths[i], &monitors[i].mask);
+        monitors[i].mask |= dirent_mask;
+        monitors[i].dir_fd = -1;
+        if (use_fid) {
+            struct statfs buffer;
+
+            /* Keep the directory open to resolve handles on its filesystem */
+            if ((monitors[i].dir_fd = open(monitors[i].path,
+                                           O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+                fstatfs(monitors[i].dir_fd, &buffer) < 0) {
+                fprintf(stderr,
+                        "Couldn't open directory '%s': '%s'\n",
+                        monitors[i].path,
+                        strerror(errno));
+                return -1;
+            }
+            monitors[i].fsid = buffer.f_fsid;
+        }
+        /* Add new fanotify-cmdline mark */
+        if (fanotify_mark(fanotify_fd,
+                          FAN_MARK_ADD,
+                          monitors[i].mask,
+                          AT_FDCWD,
+                          monitors[i].path) < 0) {
+            fprintf(stderr,
+                    "Couldn't add monitor in directory '%s': '%s'\n",
+                    monitors[i].path,
+                    strerror(errno));
+            return -1;
+        }
+
+        fprintf(use_binary || use_json ? stderr : stdout,
+                "Started monitoring directory '%s'...\n",
+                monitors[i].path);
+
+        /* Excluded paths may lie under any directory */
+        excluded_mask |= monitors[i].mask;
+    }
+
+    /* Excluded paths get ignore marks, so their events are never queued.
+     * They go away with the group. Older kernels lack FAN_MARK_IGNORE and
+     * only have the legacy ignored mask, which must survive modifications. */
+    for (i = 0; i < n_excludes; ++i) {
+        struct stat st;
+        uint64_t mask = excluded_mask;
+
+        if (!exclude_is_monitored(excludes[i])) {
+            fprintf(stderr,
+                    "Excluded path '%s' is not a monitored directory or directly in one\n",
+                    excludes[i]);
+            return -1;
+        }
+
+        /* Directory flags are only accepted on directories */
+        if (stat(excludes[i], &st) == 0 && !S_ISDIR(st.st_mode))
+            mask &= ~(FAN_ONDIR | FAN_EVENT_ON_CHILD);
+
+        if (fanotify_mark(fanotify_fd,
+                          FAN_MARK_ADD | FAN_MARK_IGNORE_SURV,
+                          mask,
+                          AT_FDCWD,
+                          excludes[i]) < 0 &&
+            (errno != EINVAL ||
+             fanotify_mark(fanotify_fd,
+                           FAN_MARK_ADD | FAN_MARK_IGNORED_MASK | FAN_MARK_IGNORED_SURV_MODIFY,
+                           mask,
+                           AT_FDCWD,
+                           excludes[i]) < 0)) {
+            fprintf(stderr,
+                    "Couldn't add ignore mark on '%s': '%s'\n",
+                    excludes[i],
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    return fanotify_fd;
+}
+
+static MAIN_HELPER void shutdown_pipeline(void) {
+    worker_t *worker;
+    int i;
+
+    /* The reader queues a stop record once it's done, the workers quit
+     * once they processed everything before it */
+    eventfd_write(pipeline.stop_fd, 1);
+    pthread_join(pipeline.reader, NULL);
+
+    for (i = 0; i < pipeline.n_workers; ++i) {
+        worker = &pipeline.workers[i];
+        pthread_join(worker->thread, NULL);
+        close(worker->ring.worker_fd);
+        munmap(worker->ring.data, worker->ring.size);
+        pid_cache_clear(worker->pid_cache);
+        free(worker->pid_cache);
+        free(worker->output->strings);
+        free(worker->output);
+    }
+
+    close(pipeline.stop_fd);
+    close(pipeline.reader_fd);
+}
+
+static MAIN_HELPER int initialize_pipeline(int fanotify_fd, int proc_fd) {
+    struct rlimit limit;
+    worker_t *worker;
+    uint64_t ring_size;
+    int error;
+    int i;
+
+    pipeline.fanotify_fd = fanotify_fd;
+    pipeline.proc_fd = proc_fd;
+    pipeline.n_workers = n_workers;
+
+    /* Events queued in the rings keep their FDs open, use as many as
+     * allowed */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    pipeline.fd_budget = (long) limit.rlim_cur - PIPELINE_RESERVED_FDS;
+    if (!use_fid && pipeline.fd_budget < 64) {
+        fprintf(stderr,
+                "Not enough FDs available for the pipeline (limit %ld)\n",
+                (long) limit.rlim_cur);
+        return -1;
+    }
+
+    if ((pipeline.stop_fd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+        (pipeline.reader_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        fprintf(stderr,
+                "Couldn't create eventfd: '%s'\n",
+                strerror(errno));
+        return -1;
+    }
+
+    /* Workers share the ring memory */
+    for (ring_size = EVENT_RING_SIZE;
+         ring_size / 2 >= EVENT_RING_MIN_SIZE && ring_size * pipeline.n_workers > EVENT_RING_SIZE;
+         ring_size /= 2);
+
+    for (i = 0; i < pipeline.n_workers; ++i) {
+        worker = &pipeline.workers[i];
+        worker->ring.size = ring_size;
+        if ((worker->ring.data = mmap(NULL,
+                                      ring_size,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS,
+                                      -1,
+                                      0)) == MAP_FAILED) {
+            fprintf(stderr,
+                    "Couldn't allocate event ring: '%s'\n",
+                    strerror(errno));
+            return -1;
+        }
+
+        if ((worker->ring.worker_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+            fprintf(stderr,
+                    "Couldn't create eventfd: '%s'\n",
+                    strerror(errno));
+            return -1;
+        }
+
+        /* Each worker owns the cmdlines of its PIDs, the /proc/<pid>/stat
+         * FDs they hold are shared among all */
+        if ((worker->pid_cache = calloc(1, sizeof(pid_cache_t))) == NULL) {
+            fprintf(stderr, "Couldn't allocate PID cache\n");
+            return -1;
+        }
+        pid_cache_init(worker->pid_cache, use_proc_connector, pipeline.n_workers);
+
+        if ((worker->output = calloc(1, sizeof(output_t))) == NULL ||
+            (use_binary &&
+             (worker->output->strings = calloc(1, sizeof(string_table_t))) == NULL)) {
+            fprintf(stderr, "Couldn't allocate output buffer\n");
+            return -1;
+        }
+        worker->output->stream = i + 1;
+
+        if ((error = pthread_create(&worker->thread, NULL, pipeline_worker_thread, worker)) != 0) {
+            fprintf(stderr,
+                    "Couldn't create thread: '%s'\n",
+                    strerror(error));
+            return -1;
+        }
+    }
+
+    if ((error = pthread_create(&pipeline.reader, NULL, pipeline_reader_thread, NULL)) != 0) {
+        fprintf(stderr,
+                "Couldn't create thread: '%s'\n",
+                strerror(error));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void shutdown_uring(void) {
+    /* Pending reads are cancelled with the ring */
+    close(uring.fd);
+    munmap(uring.sqes, uring.sqes_size);
+    munmap(uring.cq_ring, uring.cq_ring_size);
+    munmap(uring.sq_ring, uring.sq_ring_size);
+}
+
+static MAIN_HELPER int initialize_uring(void) {
+    struct io_uring_params params;
+    int files[URING_MAX_PREFETCH];
+    int i;
+
+    memset(&params, 0, sizeof(params));
+    if ((uring.fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0) {
+        fprintf(stderr,
+                "Couldn't setup io_uring: '%s'\n",
+                strerror(errno));
+        return -1;
+    }
+
+    uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if ((uring.sq_ring = mmap(NULL,
+                              uring.sq_ring_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE,
+                              uring.fd,
+                              IORING_OFF_SQ_RING)) == MAP_FAILED ||
+        (uring.cq_ring = mmap(NULL,
+                              uring.cq_ring_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE,
+                              uring.fd,
+                              IORING_OFF_CQ_RING)) == MAP_FAILED ||
+        (uring.sqes = mmap(NULL,
+                           uring.sqes_size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE,
+                           uring.fd,
+                           IORING_OFF_SQES)) == MAP_FAILED) {
+        fprintf(stderr,
+                "Couldn't map io_uring: '%s'\n",
+                strerror(errno));
+        close(uring.fd);
+        return -1;
+    }
+
+    uring.sq_head = (unsigned *) ((char *) uring.sq_ring + params.sq_off.head);
+    uring.sq_tail = (unsigned *) ((char *) uring.sq_ring + params.sq_off.tail);
+    uring.sq_mask = (unsigned *) ((char *) uring.sq_ring + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *) ((char *) uring.sq_ring + params.sq_off.array);
+    uring.sq_entries = params.sq_entries;
+    uring.sqe_tail = *uring.sq_tail;
+    uring.cq_head = (unsigned *) ((char *) uring.cq_ring + params.cq_off.head);
+    uring.cq_tail = (unsigned *) ((char *) uring.cq_ring + params.cq_off.tail);
+    uring.cq_mask = (unsigned *) ((char *) uring.cq_ring + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) ((char *) uring.cq_ring + params.cq_off.cqes);
+
+    /* Empty fixed file slots, cmdlines are opened straight into them */
+    for (i = 0; i < URING_MAX_PREFETCH; i++)
+        files[i] = -1;
+    if (syscall(__NR_io_uring_register,
+                uring.fd,
+                IORING_REGISTER_FILES,
+                files,
+                URING_MAX_PREFETCH) < 0) {
+        fprintf(stderr,
+                "Couldn't register io_uring files: '%s'\n",
+                strerror(errno));
+        shutdown_uring();
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Takes chunks out of the writer buffer (or the spill file once it is
+ * empty) and writes them out in large write()s, without holding the lock */
+static void *writer_thread(void *arg) {
+    char *batch;
+    size_t len;
+    uint64_t offset;
+    uint64_t first;
+    uint64_t chunk_len;
+    off_t spill_read;
+    ssize_t n;
+    int error;
+
+    batch = arg;
+    pthread_mutex_lock(&writer.lock);
+    for (;;) {
+        while (writer.head == writer.tail &&
+               writer.spill_read == writer.spill_write &&
+               !writer.stop)
+            pthread_cond_wait(&writer.data_ready, &writer.lock);
+
+        len = 0;
+        if (writer.head != writer.tail) {
+            /* Whole chunks, as many as fit in a batch */
+            while (writer.head != writer.tail) {
+                offset = writer.tail & (WRITER_BUFFER_SIZE - 1);
+                memcpy(&chunk_len, writer.data + offset, 8);
+                if (len + chunk_len > WRITER_BATCH_SIZE)
+                    break;
+                offset += 8;
+                first = chunk_len < WRITER_BUFFER_SIZE - offset ? chunk_len : WRITER_BUFFER_SIZE - offset;
+                memcpy(batch + len, writer.data + offset, first);
+                memcpy(batch + len + first, writer.data, chunk_len - first);
+                len += chunk_len;
+                writer.tail += (8 + chunk_len + 7) & ~(uint64_t) 7;
+            }
+            pthread_cond_broadcast(&writer.room_ready);
+            pthread_mutex_unlock(&writer.lock);
+        } else if (writer.spill_read != writer.spill_write) {
+            /* Only appended to meanwhile */
+            spill_read = writer.spill_read;
+            len = writer.spill_write - spill_read;
+            if (len > WRITER_BATCH_SIZE)
+                len = WRITER_BATCH_SIZE;
+            pthread_mutex_unlock(&writer.lock);
+
+            n = pread(writer.spill_fd, batch, len, spill_read);
+            error = errno;
+
+            pthread_mutex_lock(&writer.lock);
+            if (n <= 0) {
+                /* Nothing will come from that offset, give up the spill
+                 * instead of retrying forever */
+                fprintf(stderr,
+                        "Couldn't read spill file, dropping %llu bytes: '%s'\n",
+                        (unsigned long long) (writer.spill_write - writer.spill_read),
+                        n < 0 ? strerror(error) : "Unexpected end of file");
+                writer.dropped_bytes += writer.spill_write - writer.spill_read;
+                writer.spill_read = writer.spill_write;
+                n = 0;
+            }
+            len = n;
+            writer.spill_read += len;
+            if (writer.spill_read == writer.spill_write) {
+                writer.spill_read = 0;
+                writer.spill_write = 0;
+                ftruncate(writer.spill_fd, 0);
+            }
+            pthread_mutex_unlock(&writer.lock);
+        } else {
+            /* Stopped and everything written */
+            break;
+        }
+
+        if (len > 0 && sink_write(batch, len) < 0)
+            fprintf(stderr,
+                    "Couldn't write output: '%s'\n",
+                    strerror(errno));
+        pthread_mutex_lock(&writer.lock);
+    }
+    pthread_mutex_unlock(&writer.lock);
+
+    free(batch);
+    return NULL;
+}
+
+/* gzip a rotated segment next to it, then remove it */
+static int compress_segment(const char *path, char *buffer) {
+    char gz_path[PATH_MAX];
+    gzFile gz;
+    ssize_t len;
+    int fd;
+
+    snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if ((gz = gzopen(gz_path, "wb6")) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    while ((len = read(fd, buffer, COMPRESS_BUFFER_SIZE)) > 0) {
+        if (gzwrite(gz, buffer, (unsigned) len) != len) {
+            len = -1;
+            break;
+        }
+    }
+    close(fd);
+
+    if (gzclose(gz) != Z_OK || len < 0) {
+        unlink(gz_path);
+        return -1;
+    }
+
+    return unlink(path);
+}
+
+static void *compressor_thread(void *arg) {
+    segment_t *segment;
+    char *buffer = arg;
+
+    pthread_mutex_lock(&file_sink.lock);
+    for (;;) {
+        while (file_sink.pending == NULL && !file_sink.stop)
+            pthread_cond_wait(&file_sink.cond, &file_sink.lock);
+        if ((segment = file_sink.pending) == NULL)
+            break;
+        if ((file_sink.pending = segment->next) == NULL)
+            file_sink.pending_tail = &file_sink.pending;
+        pthread_mutex_unlock(&file_sink.lock);
+
+        if (compress_segment(segment->path, buffer) < 0)
+            fprintf(stderr,
+                    "Couldn't compress '%s': '%s'\n",
+                    segment->path,
+                    strerror(errno));
+        free(segment);
+
+        pthread_mutex_lock(&file_sink.lock);
+    }
+    pthread_mutex_unlock(&file_sink.lock);
+
+    free(buffer);
+    return NULL;
+}
+
+static MAIN_HELPER void shutdown_file_sink(void) {
+    if (file_sink.fd >= 0)
+        close(file_sink.fd);
+
+    /* Segments already rotated get compressed first */
+    if (file_sink.compress) {
+        pthread_mutex_lock(&file_sink.lock);
+        file_sink.stop = 1;
+        pthread_cond_signal(&file_sink.cond);
+        pthread_mutex_unlock(&file_sink.lock);
+        pthread_join(file_sink.compressor, NULL);
+    }
+}
+
+static MAIN_HELPER int initialize_file_sink(void) {
+    char *buffer;
+    int error;
+
+    if (file_sink_open() < 0)
+        return -1;
+
+    if (!file_sink.compress)
+        return 0;
+
+    if ((buffer = malloc(COMPRESS_BUFFER_SIZE)) == NULL) {
+        fprintf(stderr, "Couldn't allocate compression buffer\n");
+        return -1;
+    }
+
+    if ((error = pthread_create(&file_sink.compressor, NULL, compressor_thread, buffer)) != 0) {
+        fprintf(stderr,
+                "Couldn't create thread: '%s'\n",
+                strerror(error));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void metrics_write_histogram(FILE *file, histogram_t *histogram) {
+    unsigned long long cumulative = 0;
+    int i;
+
+    fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n", histogram->name, histogram->help, histogram->name);
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        cumulative += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        fprintf(file, "%s_bucket{le=\"%g\"} %llu\n", histogram->name, (double) (1ULL << i) * histogram->scale, cumulative);
+    }
+    cumulative += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    fprintf(file, "%s_bucket{le=\"+Inf\"} %llu\n", histogram->name, cumulative);
+    fprintf(file, "%s_sum %g\n", histogram->name, (double) atomic_load(&histogram->sum) * histogram->scale);
+    fprintf(file, "%s_count %llu\n", histogram->name, cumulative);
+}
+
+static void metrics_write_counter(FILE *file, const char *name, const char *help, unsigned long long value) {
+    fprintf(file, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, value);
+}
+
+/* Replace the metrics file at once, so that collectors never see it half
+ * written */
+static void metrics_write(void) {
+    char tmp_path[PATH_MAX];
+    unsigned long long dropped_chunks;
+    FILE *file;
+    int i;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics.path);
+    if ((file = fopen(tmp_path, "w")) == NULL) {
+        fprintf(stderr,
+                "Couldn't write metrics to '%s': '%s'\n",
+                tmp_path,
+                strerror(errno));
+        return;
+    }
+
+    metrics_write_counter(file, "fanotify_cmdline_reads_total", "read() calls returning events", read_stats.reads);
+    metrics_write_counter(file, "fanotify_cmdline_events_total", "Events read", read_stats.events);
+    metrics_write_counter(file, "fanotify_cmdline_queue_overflows_total", "Queue overflows", read_stats.overflows);
+    metrics_write_counter(file, "fanotify_cmdline_queue_cap_dropped_total", "Events dropped by the queue cap", read_stats.dropped);
+    metrics_write_counter(file, "fanotify_cmdline_path_filtered_total", "Events dropped by the path filter", read_stats.filtered);
+    metrics_write_counter(file, "fanotify_cmdline_process_filtered_total", "Events dropped by the process filter", read_stats.process_filtered);
+    metrics_write_counter(file, "fanotify_cmdline_coalesced_total", "Events merged into earlier records", read_stats.coalesced);
+    pthread_mutex_lock(&writer.lock);
+    dropped_chunks = writer.dropped_chunks;
+    pthread_mutex_unlock(&writer.lock);
+    metrics_write_counter(file, "fanotify_cmdline_output_dropped_chunks_total", "Output chunks dropped by the writer", dropped_chunks);
+    for (i = 0; i < METRIC_MAX; i++)
+        metrics_write_histogram(file, &histograms[i]);
+
+    if (fclose(file) != 0 || rename(tmp_path, metrics.path) < 0)
+        fprintf(stderr,
+                "Couldn't write metrics to '%s': '%s'\n",
+                metrics.path,
+                strerror(errno));
+}
+
+static void *metrics_thread(void *arg) {
+    struct timespec deadline;
+
+    (void) arg;
+
+    pthread_mutex_lock(&metrics.lock);
+    while (!metrics.stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += metrics.interval;
+        while (!metrics.stop &&
+               pthread_cond_timedwait(&metrics.cond, &metrics.lock, &deadline) != ETIMEDOUT);
+
+        pthread_mutex_unlock(&metrics.lock);
+        metrics_write();
+        pthread_mutex_lock(&metrics.lock);
+    }
+    pthread_mutex_unlock(&metrics.lock);
+
+    return NULL;
+}
+
+static MAIN_HELPER void shutdown_metrics(void) {
+    /* Writes the final values on its way out */
+    pthread_mutex_lock(&metrics.lock);
+    metrics.stop = 1;
+    pthread_cond_signal(&metrics.cond);
+    pthread_mutex_unlock(&metrics.lock);
+    pthread_join(metrics.thread, NULL);
+}
+
+static MAIN_HELPER int initialize_metrics(void) {
+    int error;
+
+    if ((error = pthread_create(&metrics.thread, NULL, metrics_thread, NULL)) != 0) {
+        fprintf(stderr,
+                "Couldn't create thread: '%s'\n",
+                strerror(error));
+        return -1;
+    }
+
+    return 0;
+}
+
+static MAIN_HELPER void shutdown_writer(void) {
+    /* Everything queued gets written first */
+    pthread_mutex_lock(&writer.lock);
+    writer.stop = 1;
+    pthread_cond_signal(&writer.data_ready);
+    pthread_mutex_unlock(&writer.lock);
+    pthread_join(writer.thread, NULL);
+
+    if (writer.spill_fd >= 0)
+        close(writer.spill_fd);
+    free(writer.data);
+
+    if (writer.dropped_chunks > 0 || writer.spilled_bytes > 0)
+        fprintf(stderr,
+                "Output dropped %llu chunks (%llu bytes), spilled %llu bytes\n",
+                writer.dropped_chunks,
+                writer.dropped_bytes,
+                writer.spilled_bytes);
+}
+
+static MAIN_HELPER int initialize_writer(void) {
+    const char *spill_dir;
+    char *batch;
+    int error;
+
+    if (writer.policy == WRITER_SPILL) {
+        if ((spill_dir = getenv("TMPDIR")) == NULL)
+            spill_dir = "/var/tmp";
+        if ((writer.spill_fd = open(spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0) {
+            fprintf(stderr,
+                    "Couldn't create spill file in '%s': '%s'\n",
+                    spill_dir,
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    if ((writer.data = malloc(WRITER_BUFFER_SIZE)) == NULL ||
+        (batch = malloc(WRITER_BATCH_SIZE)) == NULL) {
+        fprintf(stderr, "Couldn't allocate writer buffers\n");
+        return -1;
+    }
+
+    if ((error = pthread_create(&writer.thread, NULL, writer_thread, batch)) != 0) {
+        fprintf(stderr,
+                "Couldn't create thread: '%s'\n",
+                strerror(error));
+        return -1;
+    }
+
+    return 0;
+}
+
+static MAIN_HELPER void shutdown_mmap_ring(void) {
+    munmap(mmap_ring.header, MMAP_RING_HEADER_SIZE + mmap_ring.size);
+}
+
+static MAIN_HELPER int initialize_mmap_ring(void) {
+    int fd;
+
+    if ((fd = open(mmap_ring.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr,
+                "Couldn't open '%s': '%s'\n",
+                mmap_ring.path,
+                strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, MMAP_RING_HEADER_SIZE + mmap_ring.size) < 0 ||
+        (mmap_ring.header = mmap(NULL,
+                                 MMAP_RING_HEADER_SIZE + mmap_ring.size,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_SHARED,
+                                 fd,
+                                 0)) == MAP_FAILED) {
+        fprintf(stderr,
+                "Couldn't map '%s': '%s'\n",
+                mmap_ring.path,
+                strerror(errno));
+        mmap_ring.header = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    mmap_ring.data = (char *) mmap_ring.header + MMAP_RING_HEADER_SIZE;
+    mmap_ring.header->version = MMAP_RING_VERSION;
+    mmap_ring.header->header_size = MMAP_RING_HEADER_SIZE;
+    mmap_ring.header->size = mmap_ring.size;
+    mmap_ring.header->format = use_binary;
+    /* Consumers check the magic last */
+    atomic_thread_fence(memory_order_release);
+    memcpy(mmap_ring.header->magic, MMAP_RING_MAGIC, sizeof(mmap_ring.header->magic));
+
+    return 0;
+}
+
+static MAIN_HELPER void shutdown_capture(void) {
+    if (fclose(capture.file) != 0)
+        fprintf(stderr,
+                "Couldn't write capture '%s': '%s'\n",
+                capture.path,
+                strerror(errno));
+}
+
+static MAIN_HELPER int initialize_capture(void) {
+    capture_header_t header = {.magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION, .pid = self_pid};
+
+    if ((capture.file = fopen(capture.path, "we")) == NULL) {
+        fprintf(stderr,
+                "Couldn't open '%s': '%s'\n",
+                capture.path,
+                strerror(errno));
+        return -1;
+    }
+    setvbuf(capture.file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    fwrite(&header, sizeof(header), 1, capture.file);
+    return 0;
+}
+
+/* timerfd expiring every interval nanoseconds */
+static int interval_timer_create(uint64_t interval_ns) {
+    struct itimerspec interval;
+    int timer_fd;
+
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        fprintf(stderr,
+                "Couldn't create timer: '%s'\n",
+                strerror(errno));
+        return -1;
+    }
+
+    interval.it_interval.tv_sec = interval_ns / 1000000000ULL;
+    interval.it_interval.tv_nsec = interval_ns % 1000000000ULL;
+    interval.it_value = interval.it_interval;
+    if (timerfd_settime(timer_fd, 0, &interval, NULL) < 0) {
+        fprintf(stderr,
+                "Couldn't start timer: '%s'\n",
+                strerror(errno));
+        close(timer_fd);
+        return -1;
+    }
+
+    return timer_fd;
+}
+
+static MAIN_HELPER void shutdown_coalesce(void) {
+    close(coalesce.timer_fd);
+}
+
+/* Held back records are written out by the time another window elapsed */
+static MAIN_HELPER int initialize_coalesce(void) {
+    if ((coalesce.timer_fd = interval_timer_create(coalesce.window)) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Forward a record to the event processing side */
+static int proc_connector_forward(proc_record_t *record) {
+    size_t len;
+
+    len = record->lost ? sizeof(record->lost) :
+          offsetof(proc_record_t, cmdline) + (record->cmdline_len > 0 ? record->cmdline_len : 0);
+    return send(proc_connector.fds[1], record, len, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/* Only receives proc connector messages, so that the cmdline of an
+ * exec'ed process is read within microseconds of the exec. Processes that
+ * exit even sooner are still unknown. */
+static void *proc_connector_thread(void *arg) {
+    char buffer[PROC_CONNECTOR_BUFFER_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *header;
+    struct cn_msg *message;
+    struct proc_event *event;
+    struct pollfd fds[2];
+    proc_record_t record;
+    ssize_t length;
+
+    (void) arg;
+
+    fds[0].fd = proc_connector.netlink_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = proc_connector.stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr,
+                    "Couldn't poll(): '%s'\n",
+                    strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+            break;
+
+        /* Each recv() returns a single datagram, drain all pending ones */
+        while ((length = recv(proc_connector.netlink_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) != 0) {
+            if (length < 0) {
+                if (errno != ENOBUFS)
+                    break;
+                record.lost = 1;
+                if (proc_connector_forward(&record) < 0)
+                    return NULL;
+                continue;
+            }
+
+            for (header = (struct nlmsghdr *) buffer;
+                 NLMSG_OK(header, length);
+                 header = NLMSG_NEXT(header, length)) {
+                if (header->nlmsg_type == NLMSG_ERROR ||
+                    header->nlmsg_type == NLMSG_NOOP)
+                    continue;
+
+                message = NLMSG_DATA(header);
+                if (message->id.idx != CN_IDX_PROC ||
+                    message->id.val != CN_VAL_PROC)
+                    continue;
+
+                event = (struct proc_event *) message->data;
+                if (event->what != PROC_EVENT_FORK &&
+                    event->what != PROC_EVENT_EXEC &&
+                    event->what != PROC_EVENT_EXIT)
+                    continue;
+
+                record.lost = 0;
+                record.event = *event;
+                record.cmdline_len = -1;
+                if (event->what == PROC_EVENT_EXEC)
+                    record.cmdline_len = get_program_cmdline_from_pid(event->event_data.exec.process_tgid,
+                                                                      record.cmdline,
+                                                                      PATH_MAX);
+                if (proc_connector_forward(&record) < 0)
+                    return NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static MAIN_HELPER void shutdown_proc_connector(int proc_fd) {
+    if (proc_fd >= 0) {
+        /* A forward blocked on a full socket fails once nobody reads */
+        eventfd_write(proc_connector.stop_fd, 1);
+        shutdown(proc_fd, SHUT_RDWR);
+        pthread_join(proc_connector.thread, NULL);
+        close(proc_connector.stop_fd);
+        close(proc_connector.fds[1]);
+        close(proc_connector.netlink_fd);
+        close(proc_fd);
+    }
+    if (reap_timer_fd >= 0)
+        close(reap_timer_fd);
+}
+
+static MAIN_HELPER int initialize_proc_connector(void) {
+    int proc_fd;
+    int error;
+    struct sockaddr_nl address;
+    struct {
+        struct nlmsghdr header;
+        struct cn_msg message;
+        enum proc_cn_mcast_op op;
+    } __attribute__((packed)) request;
+
+    if ((proc_fd = socket(PF_NETLINK,
+                          SOCK_DGRAM | SOCK_CLOEXEC,
+                          NETLINK_CONNECTOR)) < 0) {
+        fprintf(stderr,
+                "Couldn't create proc connector socket: '%s'\n",
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    if (bind(proc_fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        fprintf(stderr,
+                "Couldn't bind proc connector socket: '%s'\n",
+                strerror(errno));
+        close(proc_fd);
+        return -1;
+    }
 
-    /* Create new fanotify-cmdline device */
-    if ((fanotify_fd = fanotify_init(FAN_CLOEXEC,
-                                     O_RDONLY | O_CLOEXEC | O_LARGEFILE)) < 0) {
+    /* Subscribe to fork/exec/exit notifications */
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = NLMSG_DONE;
+    request.message.id.idx = CN_IDX_PROC;
+    request.message.id.val = CN_VAL_PROC;
+    request.message.len = sizeof(request.op);
+    request.op = PROC_CN_MCAST_LISTEN;
+    if (send(proc_fd, &request, sizeof(request), 0) < 0) {
         fprintf(stderr,
-                "Couldn't setup new fanotify-cmdline device: %s\n",
+                "Couldn't subscribe to proc connector: '%s'\n",
                 strerror(errno));
+        close(proc_fd);
         return -1;
     }
 
-    /* Allocate array of monitor setups */
-    n_monitors = argc - 1;
-    monitors = malloc(n_monitors * sizeof(monitored_t));
+    /* Exited processes are also dropped while nothing happens */
+    if ((reap_timer_fd = interval_timer_create(PID_CACHE_REAP_INTERVAL * 1000000000ULL)) < 0) {
+        close(proc_fd);
+        return -1;
+    }
 
-    /* Loop all input directories, setting up marks */
-    for (i = 0; i < n_monitors; ++i) {
-        monitors[i].path = strdup(argv[i + 1]);
-        /* Add new fanotify-cmdline mark */
-        if (fanotify_mark(fanotify_fd,
-                          FAN_MARK_ADD,
-                          event_mask,
-                          AT_FDCWD,
-                          monitors[i].path) < 0) {
-            fprintf(stderr,
-                    "Couldn't add monitor in directory '%s': '%s'\n",
-                    monitors[i].path,
-                    strerror(errno));
-            return -1;
-        }
+    proc_connector.netlink_fd = proc_fd;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, proc_connector.fds) < 0 ||
+        (proc_connector.stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        fprintf(stderr,
+                "Couldn't create proc connector thread sockets: '%s'\n",
+                strerror(errno));
+        return -1;
+    }
 
-        printf("Started monitoring directory '%s'...\n",
-               monitors[i].path);
+    if ((error = pthread_create(&proc_connector.thread, NULL, proc_connector_thread, NULL)) != 0) {
+        fprintf(stderr,
+                "Couldn't create proc connector thread: '%s'\n",
+                strerror(error));
+        return -1;
     }
 
-    return fanotify_fd;
+    return proc_connector.fds[0];
 }
 
-static void shutdown_signals(int signal_fd) {
+static MAIN_HELPER void shutdown_signals(int signal_fd) {
     close(signal_fd);
 }
 
-static int initialize_signals(void) {
+static MAIN_HELPER int initialize_signals(void) {
     int signal_fd;
     sigset_t sigmask;
 
@@ -210,37 +5245,54 @@ static int initialize_signals(void) {
     return signal_fd;
 }
 
-int main(int argc,
-         const char **argv) {
-    int signal_fd;
-    int fanotify_fd;
-    struct pollfd fds[FD_POLL_MAX];
+/* Parse a size with an optional K, M or G suffix, 0 if invalid */
+static MAIN_HELPER size_t parse_size(const char *string) {
+    unsigned long long size;
+    char *end;
 
-    /* Input arguments... */
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s directory1 [directory2 ...]\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
+    errno = 0;
+    size = strtoull(string, &end, 10);
+    if (errno != 0 || end == string)
+        return 0;
 
-    /* Initialize signals FD */
-    if ((signal_fd = initialize_signals()) < 0) {
-        fprintf(stderr, "Couldn't initialize signals\n");
-        exit(EXIT_FAILURE);
+    switch (*end) {
+    case 'G':
+    case 'g':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+    case 'm':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+    case 'k':
+        size *= 1024;
+        end++;
+        break;
+    default:
+        break;
     }
 
-    /* Initialize fanotify-cmdline FD and the marks */
-    if ((fanotify_fd = initialize_fanotify(argc, argv)) < 0) {
-        fprintf(stderr, "Couldn't initialize fanotify-cmdline\n");
-        exit(EXIT_FAILURE);
-    }
+    return *end == '\0' ? (size_t) size : 0;
+}
+
+/* Main loop, returns once asked to stop */
+static MAIN_HELPER void poll_loop(int signal_fd, int fanotify_fd, int proc_fd, int timer_fd, int reap_fd) {
+    struct pollfd fds[FD_POLL_MAX];
+    uint64_t ticks;
 
     /* Setup polling */
     fds[FD_POLL_SIGNAL].fd = signal_fd;
     fds[FD_POLL_SIGNAL].events = POLLIN;
     fds[FD_POLL_FANOTIFY].fd = fanotify_fd;
     fds[FD_POLL_FANOTIFY].events = POLLIN;
+    fds[FD_POLL_PROC].fd = proc_fd;
+    fds[FD_POLL_PROC].events = POLLIN;
+    fds[FD_POLL_TIMER].fd = timer_fd;
+    fds[FD_POLL_TIMER].events = POLLIN;
+    fds[FD_POLL_REAP].fd = reap_fd;
+    fds[FD_POLL_REAP].events = POLLIN;
 
-    /* Now loop */
     for (;;) {
         /* Block until there is something to be read */
         if (poll(fds, FD_POLL_MAX, -1) < 0) {
@@ -265,41 +5317,841 @@ int main(int argc,
             /* Break loop if we got the expected signal */
             if (fdsi.ssi_signo == SIGINT ||
                 fdsi.ssi_signo == SIGTERM) {
-                break;
+                return;
             }
 
             fprintf(stderr,
                     "Received unexpected signal\n");
         }
 
+        /* Process events first, so that execs are known before the file
+         * events they caused */
+        if (fds[FD_POLL_PROC].revents & POLLIN)
+            proc_connector_process(fds[FD_POLL_PROC].fd);
+
         /* fanotify-cmdline event received? */
-        if (fds[FD_POLL_FANOTIFY].revents & POLLIN) {
-            char buffer[FANOTIFY_BUFFER_SIZE];
-            ssize_t length;
-
-            /* Read from the FD. It will read all events available up to
-             * the given buffer size. */
-            if ((length = read(fds[FD_POLL_FANOTIFY].fd,
-                               buffer,
-                               FANOTIFY_BUFFER_SIZE)) > 0) {
-                struct fanotify_event_metadata *metadata;
-
-                metadata = (struct fanotify_event_metadata *) buffer;
-                while (FAN_EVENT_OK (metadata, length)) {
-                    event_process(metadata);
-                    if (metadata->fd > 0)
-                        close(metadata->fd);
-                    metadata = FAN_EVENT_NEXT (metadata, length);
-                }
+        if (fds[FD_POLL_FANOTIFY].revents & POLLIN)
+            fanotify_read_events(fds[FD_POLL_FANOTIFY].fd);
+
+        /* Write out the records held back long enough */
+        if ((fds[FD_POLL_TIMER].revents & POLLIN) &&
+            read(fds[FD_POLL_TIMER].fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+            coalesce_tick(&output);
+
+        /* Drop exited processes while nothing happens */
+        if ((fds[FD_POLL_REAP].revents & POLLIN) &&
+            read(fds[FD_POLL_REAP].fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+            event_queue_idle(fanotify_fd);
+    }
+}
+
+/* Feed the batches of a capture through event processing at full speed,
+ * lookups being answered by the capture */
+static MAIN_HELPER int replay_capture(void) {
+    struct fanotify_event_metadata *metadata;
+    capture_header_t *header;
+    binary_record_t *record;
+    capture_batch_t *batch;
+    struct timespec start;
+    struct timespec end;
+    struct stat st;
+    ssize_t length;
+    double elapsed;
+    int result = 0;
+    int fd;
+
+    if ((fd = open(replay.path, O_RDONLY | O_CLOEXEC)) < 0 ||
+        fstat(fd, &st) < 0) {
+        fprintf(stderr,
+                "Couldn't open '%s': '%s'\n",
+                replay.path,
+                strerror(errno));
+        return -1;
+    }
+
+    replay.size = st.st_size;
+    header = (capture_header_t *) (replay.data = mmap(NULL, replay.size, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (replay.size < sizeof(*header) ||
+        replay.data == MAP_FAILED ||
+        memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CAPTURE_VERSION) {
+        fprintf(stderr, "Not a capture\n");
+        return -1;
+    }
+    /* Drop the events the capturer caused, not those of our own PID */
+    if (self_pid)
+        self_pid = header->pid;
+    madvise(replay.data, replay.size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    replay.offset = sizeof(*header);
+    while (replay.offset + sizeof(*record) <= replay.size) {
+        record = (binary_record_t *) (replay.data + replay.offset);
+        if (record->len < sizeof(*record) || record->len > replay.size - replay.offset) {
+            fprintf(stderr, "Truncated or corrupt capture\n");
+            result = -1;
+            break;
+        }
+        replay.offset += record->len;
+
+        /* Resolved events left over from a batch are skipped */
+        if (record->type != CAPTURE_RECORD_BATCH)
+            continue;
+
+        batch = (capture_batch_t *) record;
+        length = batch->length;
+        if (sizeof(*batch) + length > record->len) {
+            fprintf(stderr, "Truncated or corrupt capture\n");
+            result = -1;
+            break;
+        }
+        if ((size_t) length > fanotify_buffer_size) {
+            fprintf(stderr, "Captured batch larger than the event buffer, use -b\n");
+            result = -1;
+            break;
+        }
+
+        /* As read() would, into the event buffer. The captured FDs are
+         * long gone. */
+        memcpy(fanotify_buffer, batch + 1, length);
+        metadata = (struct fanotify_event_metadata *) fanotify_buffer;
+        while (FAN_EVENT_OK (metadata, length)) {
+            metadata->fd = FAN_NOFD;
+            metadata = FAN_EVENT_NEXT (metadata, length);
+        }
+
+        replay.batch.realtime.tv_sec = (time_t) (batch->realtime_ns / 1000000000ULL);
+        replay.batch.realtime.tv_nsec = (long) (batch->realtime_ns % 1000000000ULL);
+        replay.batch.monotonic.tv_sec = (time_t) (batch->monotonic_ns / 1000000000ULL);
+        replay.batch.monotonic.tv_nsec = (long) (batch->monotonic_ns % 1000000000ULL);
+        clock_gettime(CLOCK_MONOTONIC, &replay.start);
+        event_batch_process(fanotify_buffer, batch->length);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr,
+            "Replayed %llu events in %.3f s (%.0f events per second)\n",
+            (unsigned long long) read_stats.events,
+            elapsed,
+            elapsed > 0 ? read_stats.events / elapsed : 0.0);
+
+    munmap(replay.data, replay.size);
+    return result;
+}
+
+/* Strings defined so far by binary log records, by writer and ID */
+static char *decoder_strings[MAX_WORKERS + 1][STRING_TABLE_MAX_ENTRIES + 1];
+
+static const char *decoder_string(uint64_t id) {
+    if ((id >> 32) > MAX_WORKERS || (id & 0xffffffff) > STRING_TABLE_MAX_ENTRIES)
+        return NULL;
+
+    return decoder_strings[id >> 32][id & 0xffffffff];
+}
+
+/* Turn a single binary log record into text in the main output, the
+ * record must be NUL-padded */
+static void decode_binary_record(binary_record_t *record) {
+    binary_string_t *string;
+    binary_event_t *event;
+    const char *path;
+    const char *cmdline;
+
+    if (record->type == BINARY_RECORD_STRING && record->len > sizeof(*string)) {
+        string = (binary_string_t *) record;
+        if ((string->id >> 32) > MAX_WORKERS ||
+            (string->id & 0xffffffff) > STRING_TABLE_MAX_ENTRIES)
+            return;
+        free(decoder_strings[string->id >> 32][string->id & 0xffffffff]);
+        decoder_strings[string->id >> 32][string->id & 0xffffffff] =
+            strndup((char *) (string + 1), record->len - sizeof(*string));
+    } else if (record->type == BINARY_RECORD_EVENT && record->len >= sizeof(*event)) {
+        event = (binary_event_t *) record;
+        path = decoder_string(event->path_id);
+        cmdline = decoder_string(event->cmdline_id);
+
+        output.batch.realtime.tv_sec = (time_t) (event->realtime_ns / 1000000000ULL);
+        output.batch.realtime.tv_nsec = (long) (event->realtime_ns % 1000000000ULL);
+        output.batch.monotonic.tv_sec = (time_t) (event->monotonic_ns / 1000000000ULL);
+        output.batch.monotonic.tv_nsec = (long) (event->monotonic_ns % 1000000000ULL);
+        if (output.len + OUTPUT_RECORD_MAX_SIZE > OUTPUT_BUFFER_SIZE)
+            output_flush(&output);
+        if (cmdline == NULL)
+            cmdline = "unknown";
+        output_append_event(&output,
+                            event->pid,
+                            event->mask,
+                            path ? path : "unknown",
+                            cmdline,
+                            strlen(cmdline),
+                            event->lag_ns,
+                            event->count ? event->count : 1);
+    }
+}
+
+/* Convert a binary log back to the text format */
+static MAIN_HELPER int decode_binary_log(const char *path) {
+    char buffer[OUTPUT_RECORD_MAX_SIZE];
+    binary_log_header_t header;
+    binary_record_t *record;
+    FILE *file = stdin;
+
+    if (path != NULL && (file = fopen(path, "r")) == NULL) {
+        fprintf(stderr,
+                "Couldn't open '%s': '%s'\n",
+                path,
+                strerror(errno));
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, BINARY_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != BINARY_LOG_VERSION) {
+        fprintf(stderr, "Not a binary log\n");
+        return -1;
+    }
+
+    record = (binary_record_t *) buffer;
+    while (fread(record, sizeof(*record), 1, file) == 1) {
+        if (record->len < sizeof(*record) ||
+            record->len > sizeof(buffer) ||
+            fread(record + 1, record->len - sizeof(*record), 1, file) != 1) {
+            fprintf(stderr, "Truncated or corrupt binary log\n");
+            return -1;
+        }
+        decode_binary_record(record);
+    }
+    output_flush(&output);
+
+    if (file != stdin)
+        fclose(file);
+
+    return 0;
+}
+
+/* Follow a shared memory output ring, printing new events as text */
+static MAIN_HELPER int tail_mmap_ring(const char *path) {
+    mmap_ring_header_t *header;
+    binary_record_t *record;
+    struct stat st;
+    char *buffer;
+    char *data;
+    uint64_t position;
+    uint64_t head;
+    uint64_t size;
+    uint64_t len;
+    uint64_t offset;
+    uint64_t first;
+    uint64_t i;
+    ssize_t written;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 ||
+        fstat(fd, &st) < 0) {
+        fprintf(stderr,
+                "Couldn't open '%s': '%s'\n",
+                path,
+                strerror(errno));
+        return -1;
+    }
+
+    if ((size_t) st.st_size < MMAP_RING_HEADER_SIZE ||
+        (header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+        memcmp(header->magic, MMAP_RING_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MMAP_RING_VERSION ||
+        (uint64_t) st.st_size < header->header_size + header->size) {
+        fprintf(stderr, "Not an output ring\n");
+        return -1;
+    }
+    close(fd);
+
+    size = header->size;
+    data = (char *) header + header->header_size;
+    if ((buffer = malloc(size)) == NULL) {
+        fprintf(stderr, "Couldn't allocate buffer\n");
+        return -1;
+    }
+
+    /* Only new events, like tail -f */
+    position = atomic_load_explicit(&header->head, memory_order_acquire);
+    for (;;) {
+        head = atomic_load_explicit(&header->head, memory_order_acquire);
+        if (head == position) {
+            usleep(10000);
+            continue;
+        }
+
+        len = head - position;
+        if (len <= size) {
+            offset = position & (size - 1);
+            first = len < size - offset ? len : size - offset;
+            memcpy(buffer, data + offset, first);
+            memcpy(buffer + first, data, len - first);
+        }
+
+        /* Overwritten while copying? */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&header->reserve, memory_order_relaxed) - position > size) {
+            fprintf(stderr, "Consumer too slow, events lost\n");
+            position = atomic_load_explicit(&header->head, memory_order_acquire);
+            continue;
+        }
+
+        if (header->format == 0) {
+            for (i = 0; i < len; i += written) {
+                if ((written = write(STDOUT_FILENO, buffer + i, len - i)) < 0)
+                    return -1;
+            }
+        } else {
+            for (i = 0; i + sizeof(*record) <= len; i += record->len) {
+                record = (binary_record_t *) (buffer + i);
+                if (record->len < sizeof(*record) || i + record->len > len)
+                    break;
+                decode_binary_record(record);
+            }
+            output_flush(&output);
+        }
+        position = head;
+    }
+}
+
+/* The benchmarks reuse everything above with their own main() */
+#ifndef FANOTIFY_CMDLINE_NO_MAIN
+
+static void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options] directory1[=EVENTS] [directory2[=EVENTS] ...]\n"
+            "       %s decode [-T] [binary-log]\n"
+            "       %s tail [-T] output-ring\n"
+            "       %s [options] -r capture\n"
+            "Options:\n"
+            "  -p, --proc-connector  Track process cmdlines at exec time through\n"
+            "                        the kernel proc connector\n"
+            "  -f, --fid             Report file handles instead of opening files\n"
+            "  -b, --buffer-size=N   Size of the event read buffer, K/M/G suffixes\n"
+            "                        allowed (default: %d)\n"
+            "  -d, --drain           Keep reading until the event queue is empty\n"
+            "                        before going back to poll()\n"
+            "  -t, --threaded        Read events in a dedicated thread and process\n"
+            "                        them in a worker thread\n"
+            "  -w, --workers=N       Process events in N worker threads, events of\n"
+            "                        a given PID stay in order (implies -t)\n"
+            "  -u, --io-uring        Wait for events and prefetch cmdlines with\n"
+            "                        io_uring instead of poll()\n"
+            "  -B, --binary          Write a binary log instead of text, see the\n"
+            "                        decode subcommand to convert it back\n"
+            "  -j, --json            Write one JSON object per event and line\n"
+            "  -T, --timing          End text records with the nanosecond read time\n"
+            "                        and the lag until formatting\n"
+            "  -a, --async-output=P  Write output in a dedicated thread, with policy\n"
+            "                        P when it falls behind: block, drop-oldest,\n"
+            "                        drop-newest or spill (to a temporary file)\n"
+            "  -o, --output=FILE     Write output to FILE instead of stdout\n"
+            "  -s, --rotate-size=N   Rotate FILE once it reaches N bytes, K/M/G\n"
+            "                        suffixes allowed\n"
+            "  -i, --rotate-interval=S\n"
+            "                        Rotate FILE every S seconds\n"
+            "  -z, --compress        gzip rotated segments in the background\n"
+            "  -U, --unlimited-queue=N\n"
+            "                        Don't bound the kernel event queue, instead\n"
+            "                        discard the oldest events once N bytes of\n"
+            "                        them are queued (K/M/G suffixes allowed)\n"
+            "  -x, --exclude=PATH    Ignore events on PATH in the kernel, PATH being\n"
+            "                        a monitored directory or directly in one (may\n"
+            "                        be repeated)\n"
+            "  -g, --include=PATTERN Only report events on paths matching PATTERN\n"
+            "                        (may be repeated)\n"
+            "  -G, --drop=PATTERN    Don't report events on paths matching PATTERN,\n"
+            "                        before looking cmdlines up (may be repeated)\n"
+            "  -e, --include-process=RULE\n"
+            "                        Only report events of processes matching RULE:\n"
+            "                        exe:NAME (or full path), cmdline:REGEX,\n"
+            "                        uid:USER, cgroup:PATH or tree:PID (the\n"
+            "                        process and its descendants), may be repeated\n"
+            "  -E, --drop-process=RULE\n"
+            "                        Don't report events of processes matching RULE\n"
+            "  -k, --keep-self       Report events caused by fanotify-cmdline itself\n"
+            "  -n, --events=EVENTS   Events reported on directories without events\n"
+            "                        of their own, comma separated (e.g.\n"
+            "                        open,modify,close; default: open,access,\n"
+            "                        modify,close)\n"
+            "  -C, --coalesce=MS     Merge repeated reads and writes of a process on\n"
+            "                        a file into one record, written on close or\n"
+            "                        after MS milliseconds\n"
+            "  -c, --capture=FILE    Also write raw event buffers and what their\n"
+            "                        events resolved to into FILE\n"
+            "  -r, --replay=FILE     Process the events of a capture instead of\n"
+            "                        monitoring directories, at full speed\n"
+            "  -P, --metrics=FILE    Write counters and per-stage latency histograms\n"
+            "                        to FILE in Prometheus text format\n"
+            "  -I, --metrics-interval=S\n"
+            "                        Seconds between writes of the metrics file\n"
+            "                        (default: %d)\n"
+            "  -m, --mmap-output=F   Write events into a shared memory ring in file\n"
+            "                        F instead of stdout, see the tail subcommand\n"
+            "  -M, --mmap-size=N     Size of the ring data, a power of two\n"
+            "                        (default: %d)\n"
+            "  -h, --help            Show this help\n",
+            program,
+            program,
+            program,
+            program,
+            FANOTIFY_BUFFER_SIZE,
+            METRICS_INTERVAL,
+            MMAP_RING_SIZE);
+}
+
+int main(int argc,
+         const char **argv) {
+    static const struct option long_options[] = {
+        {"proc-connector", no_argument, NULL, 'p'},
+        {"fid",            no_argument, NULL, 'f'},
+        {"buffer-size",    required_argument, NULL, 'b'},
+        {"drain",          no_argument, NULL, 'd'},
+        {"threaded",       no_argument, NULL, 't'},
+        {"workers",        required_argument, NULL, 'w'},
+        {"io-uring",       no_argument, NULL, 'u'},
+        {"binary",         no_argument, NULL, 'B'},
+        {"json",           no_argument, NULL, 'j'},
+        {"timing",         no_argument, NULL, 'T'},
+        {"async-output",   required_argument, NULL, 'a'},
+        {"output",         required_argument, NULL, 'o'},
+        {"rotate-size",    required_argument, NULL, 's'},
+        {"rotate-interval", required_argument, NULL, 'i'},
+        {"compress",       no_argument, NULL, 'z'},
+        {"unlimited-queue", required_argument, NULL, 'U'},
+        {"exclude",        required_argument, NULL, 'x'},
+        {"include",        required_argument, NULL, 'g'},
+        {"drop",           required_argument, NULL, 'G'},
+        {"include-process", required_argument, NULL, 'e'},
+        {"drop-process",   required_argument, NULL, 'E'},
+        {"keep-self",      no_argument, NULL, 'k'},
+        {"events",         required_argument, NULL, 'n'},
+        {"coalesce",       required_argument, NULL, 'C'},
+        {"capture",        required_argument, NULL, 'c'},
+        {"replay",         required_argument, NULL, 'r'},
+        {"metrics",        required_argument, NULL, 'P'},
+        {"metrics-interval", required_argument, NULL, 'I'},
+        {"mmap-output",    required_argument, NULL, 'm'},
+        {"mmap-size",      required_argument, NULL, 'M'},
+        {"help",           no_argument, NULL, 'h'},
+        {NULL, 0,                       NULL, 0}
+    };
+    int signal_fd = -1;
+    int fanotify_fd = -1;
+    int proc_fd = -1;
+    int status = EXIT_SUCCESS;
+    int keep_self = 0;
+    int option;
+    int i;
+
+    /* Subcommands, -T as with text output */
+    if (argc >= 2 && (strcmp(argv[1], "decode") == 0 || strcmp(argv[1], "tail") == 0)) {
+        i = 2;
+        if (argc > i && strcmp(argv[i], "-T") == 0) {
+            use_timing = 1;
+            i++;
+        }
+        if (strcmp(argv[1], "decode") == 0)
+            return decode_binary_log(argc > i ? argv[i] : NULL) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+        if (argc == i + 1)
+            return tail_mmap_ring(argv[i]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* At most one exclude per argument */
+    if ((excludes = calloc(argc, sizeof(*excludes))) == NULL) {
+        fprintf(stderr, "Couldn't allocate exclude list\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Input arguments... */
+    while ((option = getopt_long(argc, (char *const *) argv, "pfb:dtw:uBjTa:o:s:i:zU:x:g:G:e:E:kn:C:c:r:P:I:m:M:h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'p':
+            use_proc_connector = 1;
+            break;
+        case 'f':
+            use_fid = 1;
+            break;
+        case 'b':
+            fanotify_buffer_size = parse_size(optarg);
+            if (fanotify_buffer_size < FANOTIFY_BUFFER_SIZE_MIN ||
+                fanotify_buffer_size > FANOTIFY_BUFFER_SIZE_MAX) {
+                fprintf(stderr, "Invalid buffer size '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            use_drain = 1;
+            break;
+        case 't':
+            use_pipeline = 1;
+            break;
+        case 'w':
+            n_workers = atoi(optarg);
+            if (n_workers < 1 || n_workers > MAX_WORKERS) {
+                fprintf(stderr, "Invalid number of workers '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            use_pipeline = 1;
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'B':
+            use_binary = 1;
+            break;
+        case 'j':
+            use_json = 1;
+            break;
+        case 'T':
+            use_timing = 1;
+            break;
+        case 'a':
+            use_writer = 1;
+            if (strcmp(optarg, "block") == 0) {
+                writer.policy = WRITER_BLOCK;
+            } else if (strcmp(optarg, "drop-oldest") == 0) {
+                writer.policy = WRITER_DROP_OLDEST;
+            } else if (strcmp(optarg, "drop-newest") == 0) {
+                writer.policy = WRITER_DROP_NEWEST;
+            } else if (strcmp(optarg, "spill") == 0) {
+                writer.policy = WRITER_SPILL;
+            } else {
+                fprintf(stderr, "Invalid output policy '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            file_sink.path = optarg;
+            break;
+        case 's':
+            if ((file_sink.rotate_size = parse_size(optarg)) == 0) {
+                fprintf(stderr, "Invalid rotation size '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            if ((file_sink.rotate_interval = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid rotation interval '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            file_sink.compress = 1;
+            break;
+        case 'U':
+            if ((queue_cap = parse_size(optarg)) == 0) {
+                fprintf(stderr, "Invalid queue cap '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            excludes[n_excludes++] = optarg;
+            break;
+        case 'g':
+        case 'G':
+            if (path_filter_add(optarg, option == 'g' ? PATH_FILTER_INCLUDE : PATH_FILTER_DROP) < 0) {
+                fprintf(stderr, "Couldn't add path pattern '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+        case 'E':
+            if (process_filter_add(optarg, option == 'e' ? PATH_FILTER_INCLUDE : PATH_FILTER_DROP) < 0) {
+                fprintf(stderr, "Invalid process rule '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'k':
+            keep_self = 1;
+            break;
+        case 'n':
+            if (parse_event_mask(optarg, &event_mask) < 0) {
+                fprintf(stderr, "Invalid event list '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "Invalid coalescing window '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            coalesce.window = atoi(optarg) * 1000000ULL;
+            break;
+        case 'c':
+            capture.path = optarg;
+            break;
+        case 'r':
+            replay.path = optarg;
+            break;
+        case 'P':
+            metrics.path = optarg;
+            use_metrics = 1;
+            break;
+        case 'I':
+            if ((metrics.interval = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid metrics interval '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            mmap_ring.path = optarg;
+            break;
+        case 'M':
+            mmap_ring.size = parse_size(optarg);
+            if (mmap_ring.size < MMAP_RING_MIN_SIZE ||
+                (mmap_ring.size & (mmap_ring.size - 1)) != 0) {
+                fprintf(stderr, "Invalid ring size '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!keep_self)
+        self_pid = getpid();
+
+    if (use_path_filter &&
+        path_filter_compile() < 0) {
+        fprintf(stderr, "Couldn't compile path patterns\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (optind >= argc && replay.path == NULL) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Resolved events must follow their batch in the capture */
+    if (capture.path != NULL && use_pipeline) {
+        fprintf(stderr, "Capture can't be combined with -t or -w\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Replay runs on the main thread, without the kernel */
+    if (replay.path != NULL &&
+        (use_pipeline || use_uring || use_proc_connector || capture.path != NULL || optind < argc)) {
+        fprintf(stderr, "Replay can't be combined with directories, -t, -w, -u, -p or -c\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Only the cmdline was captured, the other rules would read the /proc
+     * of whatever process holds the PID now */
+    if (replay.path != NULL) {
+        for (i = 0; i < process_filter.n_rules; i++) {
+            if (process_filter.rules[i].kind != PROCESS_RULE_CMDLINE) {
+                fprintf(stderr, "Replay only supports cmdline: process rules\n");
+                exit(EXIT_FAILURE);
             }
         }
     }
 
+    if (use_binary && use_json) {
+        fprintf(stderr, "Binary and JSON output can't be combined\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (file_sink.path == NULL &&
+        (file_sink.rotate_size > 0 || file_sink.rotate_interval > 0 || file_sink.compress)) {
+        fprintf(stderr, "Rotation and compression need an output file (-o)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (file_sink.path != NULL && mmap_ring.path != NULL) {
+        fprintf(stderr, "Output file and ring can't be combined\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The ring never blocks, it needs no writer */
+    if (use_writer && mmap_ring.path != NULL) {
+        fprintf(stderr, "Asynchronous output can't be combined with -m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The io_uring loop reads once per completion, on the main thread */
+    if (use_uring && (use_pipeline || use_drain)) {
+        fprintf(stderr, "io_uring mode can't be combined with -t, -w or -d\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Initialize signals FD */
+    if (replay.path == NULL &&
+        (signal_fd = initialize_signals()) < 0) {
+        fprintf(stderr, "Couldn't initialize signals\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Allocate the buffer to read events into */
+    if (initialize_event_buffer() < 0) {
+        fprintf(stderr, "Couldn't initialize event buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* From now on the process table is kept up to date by the proc
+     * connector, if enabled */
+    pid_cache_init(&pid_cache, use_proc_connector, 1);
+
+    /* Subscribe to process events before any fanotify event shows up */
+    if (use_proc_connector &&
+        (proc_fd = initialize_proc_connector()) < 0) {
+        fprintf(stderr, "Couldn't initialize proc connector\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Initialize fanotify-cmdline FD and the marks */
+    if (replay.path == NULL &&
+        (fanotify_fd = initialize_fanotify(argc - optind, argv + optind)) < 0) {
+        fprintf(stderr, "Couldn't initialize fanotify-cmdline\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Events are written straight to the FD, bypassing stdio */
+    fflush(stdout);
+
+    if (file_sink.path != NULL &&
+        initialize_file_sink() < 0) {
+        fprintf(stderr, "Couldn't initialize output file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (use_metrics &&
+        initialize_metrics() < 0) {
+        fprintf(stderr, "Couldn't initialize metrics\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (use_writer &&
+        initialize_writer() < 0) {
+        fprintf(stderr, "Couldn't initialize writer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mmap_ring.path != NULL &&
+        initialize_mmap_ring() < 0) {
+        fprintf(stderr, "Couldn't initialize output ring\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (capture.path != NULL &&
+        initialize_capture() < 0) {
+        fprintf(stderr, "Couldn't initialize capture\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Replays expire records by the captured read times alone */
+    if (coalesce.window > 0 &&
+        replay.path == NULL &&
+        initialize_coalesce() < 0) {
+        fprintf(stderr, "Couldn't initialize coalescing\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Ring and segment readers may start at any chunk */
+    strings_per_chunk = mmap_ring.header != NULL ||
+                        file_sink.rotate_size > 0 ||
+                        file_sink.rotate_interval > 0;
+
+    /* The binary log starts with its header, the ring header tells the
+     * format instead and output files write one per segment */
+    if (use_binary) {
+        static string_table_t strings;
+        binary_log_header_t header = {.magic = BINARY_LOG_MAGIC, .version = BINARY_LOG_VERSION};
+
+        output.strings = &strings;
+        if (mmap_ring.header == NULL && file_sink.path == NULL) {
+            output_append(&output, (const char *) &header, sizeof(header));
+            output_flush(&output);
+        }
+    }
+
+    /* In pipeline mode the threads take care of events, the main thread
+     * only waits for signals */
+    if (use_pipeline &&
+        initialize_pipeline(fanotify_fd, proc_fd) < 0) {
+        fprintf(stderr, "Couldn't initialize pipeline\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Fall back to poll() if io_uring is not available */
+    if (use_uring && initialize_uring() < 0) {
+        fprintf(stderr, "Couldn't initialize io_uring, using poll()\n");
+        use_uring = 0;
+    }
+
+    /* Now loop */
+    if (replay.path != NULL)
+        status = replay_capture() < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    else if (use_uring)
+        uring_loop(signal_fd, fanotify_fd, proc_fd);
+    else if (use_pipeline)
+        poll_loop(signal_fd, -1, -1, -1, -1);
+    else
+        poll_loop(signal_fd, fanotify_fd, proc_fd, coalesce.timer_fd, reap_timer_fd);
+
     /* Clean exit */
-    shutdown_fanotify(fanotify_fd);
-    shutdown_signals(signal_fd);
+    if (use_uring)
+        shutdown_uring();
+    if (use_pipeline)
+        shutdown_pipeline();
+    coalesce_expire(&output, UINT64_MAX);
+    output_flush(&output);
+    if (coalesce.timer_fd >= 0)
+        shutdown_coalesce();
+    if (capture.file != NULL)
+        shutdown_capture();
+    if (use_writer)
+        shutdown_writer();
+    if (use_metrics)
+        shutdown_metrics();
+    if (file_sink.path != NULL)
+        shutdown_file_sink();
+    if (fanotify_fd >= 0)
+        shutdown_fanotify(fanotify_fd);
+    shutdown_proc_connector(proc_fd);
+    shutdown_event_buffer();
+    if (mmap_ring.header != NULL)
+        shutdown_mmap_ring();
+    if (signal_fd >= 0)
+        shutdown_signals(signal_fd);
+
+    fprintf(stderr,
+            "Read %llu events in %llu reads (%.1f events per read, max %llu)\n",
+            read_stats.events,
+            read_stats.reads,
+            read_stats.reads ? (double) read_stats.events / read_stats.reads : 0.0,
+            read_stats.max_events);
+    if (read_stats.overflows > 0)
+        fprintf(stderr,
+                "Queue overflowed %llu times, %llu events dropped by the queue cap\n",
+                read_stats.overflows,
+                read_stats.dropped);
+    if (read_stats.filtered > 0)
+        fprintf(stderr,
+                "Filtered out %llu events by path\n",
+                read_stats.filtered);
+    if (read_stats.process_filtered > 0)
+        fprintf(stderr,
+                "Filtered out %llu events by process\n",
+                read_stats.process_filtered);
+    if (read_stats.coalesced > 0)
+        fprintf(stderr,
+                "Merged %llu events into earlier records\n",
+                read_stats.coalesced);
 
-    printf("Exiting fanotify-cmdline example...\n");
+    fprintf(use_binary || use_json ? stderr : stdout,
+            "Exiting fanotify-cmdline example...\n");
 
-    return EXIT_SUCCESS;
+    return status;
 }
+
+#endif /* FANOTIFY_CMDLINE_NO_MAIN */
@@ -0,0 +1,241 @@
+/* Microbenchmarks of the per-event hot paths, run in isolation from the
+ * kernel queue with fixed iteration counts */
+#define FANOTIFY_CMDLINE_NO_MAIN
+#include "fanotify-cmdline.c"
+
+/* Number of timed runs of each benchmark, the fastest is reported */
+#define MICROBENCH_RUNS 3
+
+/* A benchmark runs its operation n times */
+typedef struct {
+  const char *name;
+  unsigned long iterations;
+  void (*run)(unsigned long n);
+} microbench_t;
+
+static char microbench_buffer[PATH_MAX];
+static char microbench_cmdline[PATH_MAX];
+static size_t microbench_cmdline_len;
+static char microbench_path[PATH_MAX];
+static int microbench_fd = -1;
+static pid_t microbench_pid;
+
+static uint64_t microbench_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Start over before the output buffer fills up, nothing is written */
+static void microbench_output_reset(void) {
+    if (output.len > OUTPUT_BUFFER_SIZE - OUTPUT_RECORD_MAX_SIZE)
+        output.len = 0;
+}
+
+static void run_cmdline_from_pid(unsigned long n) {
+    while (n--)
+        get_program_cmdline_from_pid(microbench_pid, microbench_buffer, sizeof(microbench_buffer));
+}
+
+static void run_path_from_fd(unsigned long n) {
+    while (n--)
+        get_file_path_from_fd(microbench_fd, microbench_buffer, sizeof(microbench_buffer));
+}
+
+static void run_pid_cache_hit(unsigned long n) {
+    size_t len;
+
+    while (n--)
+        pid_cache_get_cmdline(&pid_cache, microbench_pid, &len);
+}
+
+static void run_mask_decode(unsigned long n) {
+    while (n--) {
+        microbench_output_reset();
+        output_append_mask(&output, FAN_OPEN | FAN_ACCESS | FAN_CLOSE_NOWRITE);
+    }
+}
+
+static void run_path_filter(unsigned long n) {
+    while (n--)
+        path_filter_accepts(microbench_path);
+}
+
+static void run_format_text(unsigned long n) {
+    while (n--) {
+        microbench_output_reset();
+        output_append_event(&output,
+                            microbench_pid,
+                            FAN_CLOSE_NOWRITE,
+                            microbench_path,
+                            microbench_cmdline,
+                            microbench_cmdline_len,
+                            n,
+                            1);
+    }
+}
+
+static void run_format_json(unsigned long n) {
+    while (n--) {
+        microbench_output_reset();
+        output_append_json_event(&output,
+                                 microbench_pid,
+                                 FAN_CLOSE_NOWRITE,
+                                 microbench_path,
+                                 microbench_cmdline,
+                                 microbench_cmdline_len,
+                                 n,
+                                 1);
+    }
+}
+
+static void run_format_binary(unsigned long n) {
+    while (n--) {
+        microbench_output_reset();
+        output_append_binary_event(&output,
+                                   microbench_pid,
+                                   FAN_CLOSE_NOWRITE,
+                                   microbench_path,
+                                   microbench_cmdline,
+                                   microbench_cmdline_len,
+                                   n,
+                                   1);
+    }
+}
+
+static const microbench_t microbenches[] = {
+  {"cmdline_from_pid", 100000, run_cmdline_from_pid},
+  {"path_from_fd", 1000000, run_path_from_fd},
+  {"pid_cache_hit", 10000000, run_pid_cache_hit},
+  {"mask_decode", 10000000, run_mask_decode},
+  {"path_filter", 2000000, run_path_filter},
+  {"format_text", 2000000, run_format_text},
+  {"format_json", 2000000, run_format_json},
+  {"format_binary", 2000000, run_format_binary},
+};
+
+static void print_microbench_usage(const char *program) {
+    size_t i;
+
+    fprintf(stderr,
+            "Usage: %s [options] [benchmark ...]\n"
+            "Options:\n"
+            "  -s, --scale=X         Multiply iteration counts by X (default: 1)\n"
+            "  -h, --help            Show this help\n"
+            "Benchmarks:\n",
+            program);
+    for (i = 0; i < sizeof(microbenches) / sizeof(microbenches[0]); ++i)
+        fprintf(stderr, "  %s\n", microbenches[i].name);
+}
+
+int main(int argc,
+         const char **argv) {
+    static const struct option long_options[] = {
+        {"scale",          required_argument, NULL, 's'},
+        {"help",           no_argument, NULL, 'h'},
+        {NULL, 0,                       NULL, 0}
+    };
+    static string_table_t strings;
+    const microbench_t *bench;
+    unsigned long iterations;
+    uint64_t best;
+    uint64_t start;
+    uint64_t elapsed;
+    double scale = 1.0;
+    ssize_t len;
+    size_t i;
+    int option;
+    int run;
+    int j;
+
+    while ((option = getopt_long(argc, (char *const *) argv, "s:h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 's':
+            if ((scale = atof(optarg)) <= 0) {
+                fprintf(stderr, "Invalid scale '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            print_microbench_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            print_microbench_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Events of this very process on one of its own files */
+    microbench_pid = getpid();
+    if ((len = get_program_cmdline_from_pid(microbench_pid,
+                                            microbench_cmdline,
+                                            sizeof(microbench_cmdline))) < 0) {
+        fprintf(stderr, "Couldn't read own cmdline\n");
+        exit(EXIT_FAILURE);
+    }
+    microbench_cmdline_len = len;
+
+    if ((microbench_fd = open(argv[0], O_RDONLY | O_CLOEXEC)) < 0 ||
+        get_file_path_from_fd(microbench_fd, microbench_path, sizeof(microbench_path)) == NULL) {
+        fprintf(stderr,
+                "Couldn't open '%s': '%s'\n",
+                argv[0],
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Lookups within a single read batch hit the cache */
+    pid_cache_init(&pid_cache, 0, 1);
+    pid_cache.generation = 1;
+    run_pid_cache_hit(1);
+
+    /* A typical set of rules, none of which drops the path */
+    path_filter_add("/", PATH_FILTER_INCLUDE);
+    path_filter_add("/proc", PATH_FILTER_DROP);
+    path_filter_add("/home/**/.git/**", PATH_FILTER_DROP);
+    path_filter_add("**/node_modules/**", PATH_FILTER_DROP);
+    path_filter_add("*.swp", PATH_FILTER_DROP);
+    path_filter_add("*~", PATH_FILTER_DROP);
+    path_filter_compile();
+
+    batch_time_get(&output.batch);
+    output.strings = &strings;
+
+    for (i = 0; i < sizeof(microbenches) / sizeof(microbenches[0]); ++i) {
+        bench = &microbenches[i];
+
+        /* Only the benchmarks named, if any */
+        if (optind < argc) {
+            for (j = optind; j < argc && strcmp(argv[j], bench->name) != 0; j++);
+            if (j == argc)
+                continue;
+        }
+
+        iterations = bench->iterations * scale;
+        if (iterations == 0)
+            iterations = 1;
+
+        /* Warm up caches first */
+        bench->run(iterations / 10);
+
+        best = UINT64_MAX;
+        for (run = 0; run < MICROBENCH_RUNS; run++) {
+            start = microbench_now();
+            bench->run(iterations);
+            elapsed = microbench_now() - start;
+            if (elapsed < best)
+                best = elapsed;
+        }
+
+        printf("%-20s %12lu iterations %10.1f ns/op\n",
+               bench->name,
+               iterations,
+               (double) best / iterations);
+    }
+
+    close(microbench_fd);
+    pid_cache_clear(&pid_cache);
+
+    return EXIT_SUCCESS;
+}